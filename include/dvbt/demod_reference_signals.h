@@ -46,6 +46,12 @@ namespace gr {
         * constructor is in a private implementation
         * class. dvbt::demod_reference_signals::make is the public interface for
         * creating new instances.
+        *
+        * The transmission parameters received with TPS are sent downstream
+        * with a transmission_parameters tag (packed as in
+        * dvbt_config::get_transmission_parameters()). Demap, bit inner
+        * deinterleaver and Viterbi decoder change constellation, hierarchy
+        * and code rate on it.
         */
        static sptr make(int itemsize, int ninput, int noutput, \
         dvbt_constellation_t constellation, dvbt_hierarchy_t hierarchy, \
@@ -141,14 +141,34 @@ namespace gr {
       dvbt_code_rate_t get_code_rate_HP();
       void set_code_rate_LP(dvbt_code_rate_t coderate);
       dvbt_code_rate_t get_code_rate_LP();
+      void set_guard_interval(dvbt_guard_interval_t guard_interval);
+      dvbt_guard_interval_t get_guard_interval();
       void set_transmission_mode(dvbt_transmission_mode_t transmission_mode);
       dvbt_transmission_mode_t get_transmission_mode();
+      /*!
+       * Transmission parameters packed in one word as sent with
+       * transmission_parameters tags: \n
+       * bits 0-1 constellation, bits 2-4 hierarchy, \n
+       * bits 5-7 HP code rate, bits 8-10 LP code rate, \n
+       * bits 11-12 guard interval, bits 13-14 transmission mode. \n
+       */
+      long get_transmission_parameters() const;
+      void set_transmission_parameters(long params);
 
       dvbt_config(dvbt_constellation_t constellation = gr::dvbt::QAM16, \
           dvbt_hierarchy_t hierarchy = gr::dvbt::NH, dvbt_code_rate_t code_rate_HP = gr::dvbt::C1_2, \
           dvbt_code_rate_t code_rate_LP = gr::dvbt::C1_2, dvbt_guard_interval_t guard_interval = gr::dvbt::G1_32, \
           dvbt_transmission_mode_t transmission_mode = gr::dvbt::T2k, int include_cell_id = 0, int cell_id = 0);
       ~dvbt_config();
+
+      private:
+      // Update parameters derived from the transmission parameters
+      void update_transmission_mode();
+      void update_constellation();
+      void update_code_rate();
+      void update_guard_interval();
+      void update_hierarchy();
+      void update_norm();
     }; 
   } // namespace dvbt
 } // namespace gr
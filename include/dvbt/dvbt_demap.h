@@ -46,8 +46,12 @@ namespace gr {
         * constructor is in a private implementation
         * class. dvbt::dvbt_demap::make is the public interface for
         * creating new instances.
+        *
+        * When \p deinterleave is set the block also does the symbol
+        * deinterleaving (ETSI EN 300 744 Clause 4.3.4.2) and its output
+        * goes straight to the bit inner deinterleaver.
         */
-       static sptr make(int nsize, dvbt_constellation_t constellation, dvbt_hierarchy_t hierarchy, dvbt_transmission_mode_t transmission, float gain);
+       static sptr make(int nsize, dvbt_constellation_t constellation, dvbt_hierarchy_t hierarchy, dvbt_transmission_mode_t transmission, float gain, int deinterleave = 0);
     };
 
   } // namespace dvbt
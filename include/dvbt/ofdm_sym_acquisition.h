@@ -45,8 +45,12 @@ namespace gr {
         * constructor is in a private implementation
         * class. dvbt::ofdm_sym_acquisition::make is the public interface for
         * creating new instances.
+        *
+        * When \p do_fft is set the block also does the FFT of each
+        * acquired symbol and outputs it in frequency domain
+        * with DC on the middle (as fft_vxx with shift).
         */
-       static sptr make(int blocks, int fft_length, int occupied_tones, int cp_length, float snr);
+       static sptr make(int blocks, int fft_length, int occupied_tones, int cp_length, float snr, int do_fft = 0);
     };
 
   } // namespace dvbt
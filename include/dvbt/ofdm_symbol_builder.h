@@ -0,0 +1,63 @@
+/* -*- c++ -*- */
+/* 
+ * Copyright 2013 <Bogdan Diaconescu, yo3iiu@yo3iiu.ro>.
+ * 
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ * 
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef INCLUDED_DVBT_OFDM_SYMBOL_BUILDER_H
+#define INCLUDED_DVBT_OFDM_SYMBOL_BUILDER_H
+
+#include <dvbt/api.h>
+#include <dvbt/dvbt_config.h>
+#include <gnuradio/block.h>
+
+namespace gr {
+  namespace dvbt {
+
+    /*!
+     * \brief OFDM symbol builder class.
+     * Does in one block the job of dvbt_map, symbol_inner_interleaver
+     * (interleave) and reference_signals: maps the bit interleaved symbols
+     * straight into their carriers of an IFFT input with all pilots.
+     * \ingroup dvbt
+     *
+     */
+    class DVBT_API ofdm_symbol_builder : virtual public block
+    {
+    public:
+       typedef boost::shared_ptr<ofdm_symbol_builder> sptr;
+
+       /*!
+        * \brief Return a shared_ptr to a new instance of dvbt::ofdm_symbol_builder.
+        *
+        * To avoid accidental use of raw pointers, dvbt::ofdm_symbol_builder's
+        * constructor is in a private implementation
+        * class. dvbt::ofdm_symbol_builder::make is the public interface for
+        * creating new instances.
+        */
+       static sptr make(dvbt_constellation_t constellation, dvbt_hierarchy_t hierarchy, \
+           dvbt_code_rate_t code_rate_HP, dvbt_code_rate_t code_rate_LP, \
+           dvbt_guard_interval_t guard_interval, dvbt_transmission_mode_t transmission_mode, \
+           int include_cell_id, int cell_id, float gain);
+    };
+
+  } // namespace dvbt
+} // namespace gr
+
+#endif /* INCLUDED_DVBT_OFDM_SYMBOL_BUILDER_H */
+
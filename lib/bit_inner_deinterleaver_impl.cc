@@ -24,7 +24,9 @@
 
 #include <gnuradio/io_signature.h>
 #include "bit_inner_deinterleaver_impl.h"
+#include "bit_planes.h"
 #include <stdio.h>
+#include <string.h>
 
 namespace gr {
   namespace dvbt {
@@ -75,40 +77,92 @@ namespace gr {
           io_signature::make(1, 2, sizeof (unsigned char) * nsize)),
       config(constellation, hierarchy, gr::dvbt::C1_2, gr::dvbt::C1_2, gr::dvbt::G1_32, transmission),
       d_nsize(nsize),
-      d_hierarchy(hierarchy)
+      d_hierarchy(hierarchy),
+      d_params_key(pmt::string_to_symbol("transmission_parameters"))
+    {
+      build_tables();
+
+      bit_planes_spread_init(d_spread);
+
+      if (d_nsize % d_bsize)
+        std::cout << "Error: Input size must be multiple of block size: " \
+          << "nsize: " << d_nsize << "bsize: " << d_bsize << std::endl;
+    }
+
+    /*
+     * Our virtual destructor.
+     */
+    bit_inner_deinterleaver_impl::~bit_inner_deinterleaver_impl()
+    {
+    }
+
+    void
+    bit_inner_deinterleaver_impl::build_tables()
     {
       d_v = config.d_m;
       d_hierarchy = config.d_hierarchy;
 
-      d_perm = (unsigned char *)new unsigned char[d_v * d_bsize];
-      if (d_perm == NULL)
+      if ((d_hierarchy != gr::dvbt::NH) && (d_v < 4))
       {
-        std::cout << "Error allocating d_perm" << std::endl;
-        return;
+        std::cout << "Error: hierarchical mode needs QAM16 or QAM64, using non hierarchical" << std::endl;
+        d_hierarchy = gr::dvbt::NH;
       }
 
-      //Init permutation table (used for b[e][do])
-      for (int i = 0; i <  d_bsize * d_v; i++)
+      // The whole block is a fixed permutation of bits. Each bit interleaver
+      // is a rotation of a plane and the demultiplexer only tells
+      // where each plane goes (output stream and bit position).
+      for (int e = 0; e < d_v; e++)
+        d_rotate[e] = H(e, 0);
+
+      if (d_hierarchy == gr::dvbt::NH)
       {
-        if (d_hierarchy == gr::dvbt::NH)
-          d_perm[i] = ((i % d_v) / (d_v / 2)) + 2 * (i % (d_v / 2));
-        else
+        for (int k = 0; k < d_v; k++)
         {
-          d_perm[i] = (i % (d_v - 2)) / ((d_v - 2) / 2) + 2 * (i % ((d_v - 2) / 2)) + 2;
+          int e = ((k % d_v) / (d_v / 2)) + 2 * (k % (d_v / 2));
+
+          d_stream[e] = 0;
+          d_shift[e] = d_v - k - 1;
         }
       }
+      else
+      {
+        // High priority output - first 2 streams
+        for (int k = 0; k < 2; k++)
+        {
+          d_stream[k] = 0;
+          d_shift[k] = 1 - k;
+        }
 
-      if (d_nsize % d_bsize)
-        std::cout << "Error: Input size must be multiple of block size: " \
-          << "nsize: " << d_nsize << "bsize: " << d_bsize << std::endl;
+        // Low priority output - (v - 2) streams
+        for (int k = 0; k < (d_v - 2); k++)
+        {
+          int e = (k % (d_v - 2)) / ((d_v - 2) / 2) + 2 * (k % ((d_v - 2) / 2)) + 2;
+
+          d_stream[e] = 1;
+          d_shift[e] = d_v - k - 3;
+        }
+      }
     }
 
     /*
-     * Our virtual destructor.
+     * Change constellation and hierarchy to the ones received
+     * with a transmission_parameters tag.
      */
-    bit_inner_deinterleaver_impl::~bit_inner_deinterleaver_impl()
+    void
+    bit_inner_deinterleaver_impl::set_transmission_parameters(long params)
     {
-      delete [] d_perm;
+      dvbt_config rcv(config);
+      rcv.set_transmission_parameters(params);
+
+      if ((rcv.d_constellation == config.d_constellation) && (rcv.d_hierarchy == config.d_hierarchy))
+        return;
+
+      config.set_constellation(rcv.d_constellation);
+      config.set_hierarchical(rcv.d_hierarchy);
+
+      build_tables();
+
+      printf("Bit inner deinterleaver, v: %i, hierarchy: %i\n", d_v, d_hierarchy);
     }
 
     void
@@ -125,55 +179,59 @@ namespace gr {
     {
         const unsigned char *in = (const unsigned char *) input_items[0];
         unsigned char *outh = (unsigned char *) output_items[0];
-        unsigned char *outl = (unsigned char *) output_items[1];
+        unsigned char *outl = NULL;
 
-        int bmax = noutput_items * d_nsize / d_bsize;
+        if (output_items.size() > 1)
+          outl = (unsigned char *) output_items[1];
 
-        // First index of d_b is Bit interleaver number
-        // Second index of d_b is the position inside Bit interleaver
-        unsigned char d_b[d_v][d_bsize];
+        // Blocks in one item
+        int bitem = d_nsize / d_bsize;
+        int bmax = noutput_items * bitem;
 
-        for (int bcount = 0; bcount < bmax; bcount++)
-        {
-          for (int w = 0; w < d_bsize; w++)
-          {
-            int c = in[(bcount * d_bsize) + w];
-
-            for (int e = 0; e < d_v; e++)
-              d_b[e][H(e, w)] = (c >> (d_v - e - 1)) & 1; 
-          }
+        const uint64_t nread = this->nitems_read(0); //number of items read on port 0
 
-          for (int i = 0; i < d_bsize; i++)
-          {
-            if (d_hierarchy == gr::dvbt::NH)
-            {
-              // Create output from demultiplexer
-              int c = 0;
+        // Demod reference signals sends the transmission parameters
+        // received with TPS when they change.
+        this->get_tags_in_range(d_params_tags, 0, nread, nread + noutput_items, d_params_key);
 
-              for (int k = 0; k < d_v; k++)
-                c = (c << 1) | d_b[d_perm[(d_v * i) + k]][i];
+        // Input block padded for SSE2 loads
+        unsigned char inb[BIT_PLANE_PADDED];
+        memset(&inb[d_bsize], 0, BIT_PLANE_PADDED - d_bsize);
 
-              outh[(bcount * d_bsize) + i] = c;
-            }
-            else
-            {
-              int c = 0;
+        // First index of planes is bit number inside the input symbol
+        uint64_t planes[6][2];
+        uint64_t rot[2];
+        // Output blocks for high and low priority streams
+        uint64_t outb[2][BIT_PLANE_PADDED / 8];
 
-              // High priority output - first 2 streams
-              for (int k = 0; k < 2; k++)
-                c = (c << 1) | d_b[(d_v * i + k) % 2][(d_v * i + k) / 2];
+        for (int bcount = 0, p = 0; bcount < bmax; bcount++)
+        {
+          // New constellation starts with this item
+          while ((p < (int)d_params_tags.size()) && \
+              (d_params_tags[p].offset == (nread + bcount / bitem)) && ((bcount % bitem) == 0))
+          {
+            set_transmission_parameters(pmt::to_long(d_params_tags[p].value));
+            p++;
+          }
 
-              outh[(bcount * d_bsize) + i] = c;
+          memcpy(inb, &in[bcount * d_bsize], d_bsize);
+          bit_planes_extract(inb, d_v, planes);
 
-              c = 0;
-              // Low priority output - (v - 2) streams
-              for (int k = 2; k < (d_v - 2); k++)
-                c = (c << 1) | d_b[d_perm[d_v * i + k]][(d_v * i + k) / (d_v - 2)];
+          memset(outb, 0, sizeof(outb));
 
-              outl[(bcount * d_bsize) + i] = c;
-            }
+          // Bit interleaver e takes bit (v - e - 1) of each symbol
+          for (int e = 0; e < d_v; e++)
+          {
+            bit_plane_rotate(planes[d_v - e - 1], d_rotate[e], rot);
+            bit_plane_insert(rot, d_shift[e], d_spread, outb[d_stream[e]]);
           }
+
+          memcpy(&outh[bcount * d_bsize], outb[0], d_bsize);
+
+          if (outl)
+            memcpy(&outl[bcount * d_bsize], outb[1], d_bsize);
         }
+
         // Do <+signal processing+>
         // Tell runtime system how many input items we consumed on
         // each input stream.
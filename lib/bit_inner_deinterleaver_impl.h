@@ -23,6 +23,7 @@
 
 #include <dvbt/bit_inner_deinterleaver.h>
 #include <dvbt/dvbt_config.h>
+#include <stdint.h>
 
 namespace gr {
   namespace dvbt {
@@ -38,7 +39,8 @@ namespace gr {
     class bit_inner_deinterleaver_impl : public bit_inner_deinterleaver
     {
     private:
-      const dvbt_config config;
+      // updated from transmission parameters tags
+      dvbt_config config;
 
       int d_nsize;
       dvbt_hierarchy_t d_hierarchy;
@@ -48,11 +50,23 @@ namespace gr {
       // Bit interleaver block size
       static const int d_bsize;
 
-      // Table to keep interleaved indices
-      unsigned char * d_perm;
-      
+      // Rotation of the plane of each bit interleaver
+      int d_rotate[6];
+      // Output stream and bit position for each bit interleaver
+      int d_stream[6];
+      int d_shift[6];
+      // Table used to spread a plane back to symbols
+      uint64_t d_spread[256];
+
+      //Transmission parameters tags read in one call
+      std::vector<tag_t> d_params_tags;
+      const pmt::pmt_t d_params_key;
+
       // Permutation function
       int H(int e, int w);
+      // Build permutation tables for current constellation and hierarchy
+      void build_tables();
+      void set_transmission_parameters(long params);
 
     public:
       bit_inner_deinterleaver_impl(int nsize, \
@@ -24,7 +24,9 @@
 
 #include <gnuradio/io_signature.h>
 #include "bit_inner_interleaver_impl.h"
+#include "bit_planes.h"
 #include <stdio.h>
+#include <string.h>
 
 namespace gr {
   namespace dvbt {
@@ -80,24 +82,50 @@ namespace gr {
       d_v = config.d_m;
       d_hierarchy = config.d_hierarchy;
 
-      d_perm = (unsigned char *)new unsigned char[d_v * d_bsize];
-      if (d_perm == NULL)
+      if ((d_hierarchy != gr::dvbt::NH) && (d_v < 4))
       {
-        std::cout << "Error allocating d_perm" << std::endl;
-        return;
+        std::cout << "Error: hierarchical mode needs QAM16 or QAM64, using non hierarchical" << std::endl;
+        d_hierarchy = gr::dvbt::NH;
       }
 
-      //Init permutation table (used for b[e][do])
-      for (int i = 0; i <  d_bsize * d_v; i++)
+      // The whole block is a fixed permutation of bits. The demultiplexer
+      // only tells where each bit interleaver takes its input from
+      // (input stream and bit position) and each bit interleaver
+      // is a rotation of a plane. Output bit (v - e - 1) is interleaver e.
+      for (int e = 0; e < d_v; e++)
+        d_rotate[e] = (d_bsize - H(e, 0)) % d_bsize;
+
+      if (d_hierarchy == gr::dvbt::NH)
+      {
+        for (int k = 0; k < d_v; k++)
+        {
+          int e = ((k % d_v) / (d_v / 2)) + 2 * (k % (d_v / 2));
+
+          d_stream[e] = 0;
+          d_shift[e] = d_v - k - 1;
+        }
+      }
+      else
       {
-        if (d_hierarchy == gr::dvbt::NH)
-          d_perm[i] = ((i % d_v) / (d_v / 2)) + 2 * (i % (d_v / 2));
-        else
+        // High priority input - first 2 streams
+        for (int k = 0; k < 2; k++)
         {
-          d_perm[i] = (i % (d_v - 2)) / ((d_v - 2) / 2) + 2 * (i % ((d_v - 2) / 2)) + 2;
+          d_stream[k] = 0;
+          d_shift[k] = 1 - k;
+        }
+
+        // Low priority input - (v - 2) streams
+        for (int k = 0; k < (d_v - 2); k++)
+        {
+          int e = (k % (d_v - 2)) / ((d_v - 2) / 2) + 2 * (k % ((d_v - 2) / 2)) + 2;
+
+          d_stream[e] = 1;
+          d_shift[e] = d_v - k - 3;
         }
       }
 
+      bit_planes_spread_init(d_spread);
+
       if (d_nsize % d_bsize)
         std::cout << "Error: Input size must be multiple of block size: " \
           << "nsize: " << d_nsize << "bsize: " << d_bsize << std::endl;
@@ -108,14 +136,14 @@ namespace gr {
      */
     bit_inner_interleaver_impl::~bit_inner_interleaver_impl()
     {
-      delete [] d_perm;
     }
 
     void
     bit_inner_interleaver_impl::forecast (int noutput_items, gr_vector_int &ninput_items_required)
     {
-        ninput_items_required[0] = noutput_items;
-        ninput_items_required[1] = noutput_items;
+        unsigned ninputs = ninput_items_required.size();
+        for (unsigned i = 0; i < ninputs; i++)
+          ninput_items_required[i] = noutput_items;
     }
 
     int
@@ -125,54 +153,47 @@ namespace gr {
                        gr_vector_void_star &output_items)
     {
         const unsigned char *inh = (const unsigned char *) input_items[0];
-        const unsigned char *inl = (const unsigned char *) input_items[1];
+        const unsigned char *inl = NULL;
         unsigned char *out = (unsigned char *) output_items[0];
 
+        if ((d_hierarchy != gr::dvbt::NH) && (input_items.size() > 1))
+          inl = (const unsigned char *) input_items[1];
+
         int bmax = noutput_items * d_nsize / d_bsize;
 
-        // First index of d_b is Bit interleaver number
-        // Second index of d_b is the position inside the Bit interleaver
-        unsigned char d_b[d_v][d_bsize];
+        // Input blocks padded for SSE2 loads
+        unsigned char inb[2][BIT_PLANE_PADDED];
+        memset(inb, 0, sizeof(inb));
+
+        // First index of planes is input stream
+        // Second index of planes is bit number inside the input symbol
+        uint64_t planes[2][6][2];
+        uint64_t rot[2];
+        memset(planes, 0, sizeof(planes));
+        uint64_t outb[BIT_PLANE_PADDED / 8];
 
         for (int bcount = 0; bcount < bmax; bcount++)
         {
-          for (int i = 0; i < d_bsize; i++)
+          memcpy(inb[0], &inh[bcount * d_bsize], d_bsize);
+          bit_planes_extract(inb[0], d_v, planes[0]);
+
+          if (inl)
           {
-            if (d_hierarchy == gr::dvbt::NH)
-            {
-              int c = inh[bcount * d_bsize + i];
-
-              // Create the demultiplexer
-              for (int k = 0; k < d_v; k++)
-                d_b[d_perm[(d_v * i) + k]][i] = (c >> (d_v - k - 1)) & 1;
-            }
-            else
-            {
-              int ch = inh[(bcount * d_bsize) + i];
-              int cl = inl[(bcount * d_bsize) + i];
-
-              // High priority input - first 2 streams
-              for (int k = 0; k < 2; k++)
-                d_b[(d_v * i + k) % 2][(d_v * i + k) / 2] = (ch >> (1 - k)) & 1;
-
-              // Low priority input - (v - 2) streams
-              for (int k = 2; k < (d_v - 2); k++)
-                d_b[d_perm[d_v * i + k]][(d_v * i + k) / (d_v - 2)] = (cl >> (d_v - k - 1)) & 1;
-            }
+            memcpy(inb[1], &inl[bcount * d_bsize], d_bsize);
+            bit_planes_extract(inb[1], d_v - 2, planes[1]);
           }
 
+          memset(outb, 0, sizeof(outb));
+
           // Take one bit from each interleaver
           // and format the output
-
-          for (int w = 0; w < d_bsize; w++)
+          for (int e = 0; e < d_v; e++)
           {
-            int val = 0;
-
-            for (int e = 0; e < d_v; e++)
-              val = (val << 1) | d_b[e][H(e, w)];
-
-            out[(bcount * d_bsize) + w] = val;
+            bit_plane_rotate(planes[d_stream[e]][d_shift[e]], d_rotate[e], rot);
+            bit_plane_insert(rot, d_v - e - 1, d_spread, outb);
           }
+
+          memcpy(&out[bcount * d_bsize], outb, d_bsize);
         }
 
         // Do <+signal processing+>
@@ -23,6 +23,7 @@
 
 #include <dvbt/bit_inner_interleaver.h>
 #include <dvbt/dvbt_config.h>
+#include <stdint.h>
 
 namespace gr {
   namespace dvbt {
@@ -47,9 +48,14 @@ namespace gr {
       // Bit interleaver block size
       static const int d_bsize;
 
-      // Table to keep interleaved indices
-      unsigned char * d_perm;
-      
+      // Rotation of the plane of each bit interleaver
+      int d_rotate[6];
+      // Input stream and bit position for each bit interleaver
+      int d_stream[6];
+      int d_shift[6];
+      // Table used to spread a plane back to symbols
+      uint64_t d_spread[256];
+
       // Permutation function
       int H(int e, int w);
 
@@ -0,0 +1,148 @@
+/* -*- c++ -*- */
+/*
+ * Copyright 2013 <Bogdan Diaconescu, yo3iiu@yo3iiu.ro>.
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef INCLUDED_DVBT_BIT_PLANES_H
+#define INCLUDED_DVBT_BIT_PLANES_H
+
+#include <stdint.h>
+#include <emmintrin.h>
+
+/*
+ * Helpers used by bit inner interleaver/deinterleaver.
+ *
+ * A bit interleaver block (126 symbols) is kept as a set of bit planes,
+ * one plane for each bit of a symbol. Bit w of a plane belongs to
+ * symbol w of the block. A plane is 126 bits long and is kept in
+ * two 64bit words (LSB first).
+ *
+ * The bit interleavers of ETSI EN 300 744 Clause 4.3.4.1 are
+ * cyclic shifts of the block, therefore they become rotations of planes.
+ */
+
+namespace gr {
+  namespace dvbt {
+
+    // Length of a plane (bit interleaver block size)
+    const int BIT_PLANE_SIZE = 126;
+    // Bytes needed to keep one block of symbols padded for SSE2 loads
+    const int BIT_PLANE_PADDED = 128;
+
+    /*
+     * Build the table used to spread 8 bits of a plane
+     * to 8 bytes (bit t goes to bit 0 of byte t).
+     */
+    static inline void
+    bit_planes_spread_init(uint64_t * spread)
+    {
+      for (int i = 0; i < 256; i++)
+      {
+        spread[i] = 0;
+
+        for (int t = 0; t < 8; t++)
+          spread[i] |= (uint64_t)((i >> t) & 1) << (8 * t);
+      }
+    }
+
+    /*
+     * Extract nplanes planes from a block of symbols.
+     * Plane b keeps bit b of each symbol.
+     * in must have BIT_PLANE_PADDED readable bytes.
+     */
+    static inline void
+    bit_planes_extract(const unsigned char * in, int nplanes, uint64_t planes[][2])
+    {
+      for (int b = 0; b < nplanes; b++)
+        planes[b][0] = planes[b][1] = 0;
+
+      for (int c = 0; c < (BIT_PLANE_PADDED / 16); c++)
+      {
+        __m128i x = _mm_loadu_si128((const __m128i *)&in[16 * c]);
+
+        // Bring bit b of each byte on MSB and collect the MSBs
+        for (int b = 0; b < nplanes; b++)
+        {
+          uint64_t m = (uint16_t)_mm_movemask_epi8(_mm_slli_epi16(x, 7 - b));
+          planes[b][c >> 2] |= m << (16 * (c & 3));
+        }
+      }
+
+      // Get rid of the padding
+      for (int b = 0; b < nplanes; b++)
+        planes[b][1] &= ((uint64_t)1 << (BIT_PLANE_SIZE - 64)) - 1;
+    }
+
+    /*
+     * Rotate a plane to the left by r (0 <= r < BIT_PLANE_SIZE):
+     * bit w of in goes to bit (w + r) % BIT_PLANE_SIZE of out.
+     */
+    static inline void
+    bit_plane_rotate(const uint64_t in[2], int r, uint64_t out[2])
+    {
+      if (r == 0)
+      {
+        out[0] = in[0]; out[1] = in[1];
+        return;
+      }
+
+      uint64_t l0, l1, r0, r1;
+      int s = BIT_PLANE_SIZE - r;
+
+      // in << r
+      if (r >= 64)
+      {
+        l1 = in[0] << (r - 64); l0 = 0;
+      }
+      else
+      {
+        l1 = (in[1] << r) | (in[0] >> (64 - r)); l0 = in[0] << r;
+      }
+
+      // in >> (BIT_PLANE_SIZE - r)
+      if (s >= 64)
+      {
+        r0 = in[1] >> (s - 64); r1 = 0;
+      }
+      else
+      {
+        r0 = (in[0] >> s) | (in[1] << (64 - s)); r1 = in[1] >> s;
+      }
+
+      out[0] = l0 | r0;
+      out[1] = (l1 | r1) & (((uint64_t)1 << (BIT_PLANE_SIZE - 64)) - 1);
+    }
+
+    /*
+     * Insert a plane into a block of symbols on bit position shift.
+     * out is a block of BIT_PLANE_PADDED bytes kept as 64bit words.
+     */
+    static inline void
+    bit_plane_insert(const uint64_t plane[2], int shift, const uint64_t * spread, uint64_t * out)
+    {
+      for (int j = 0; j < (BIT_PLANE_PADDED / 8); j++)
+      {
+        unsigned int bits = (plane[j >> 3] >> (8 * (j & 7))) & 0xff;
+        out[j] |= spread[bits] << shift;
+      }
+    }
+
+  } // namespace dvbt
+} // namespace gr
+
+#endif /* INCLUDED_DVBT_BIT_PLANES_H */
@@ -66,7 +66,30 @@ namespace gr {
           d_ninput(ninput), d_noutput(noutput),
           d_pg(config),
           d_init(0),
-          d_fi_start(0)
+          d_fi_start(0),
+          d_symbol_index(0),
+          d_send_symbol_index(1),
+          d_symbol_index_key(pmt::string_to_symbol("symbol_index")),
+          d_params(-1),
+          d_send_params(0),
+          d_params_key(pmt::string_to_symbol("transmission_parameters")),
+          d_timing_port(pmt::mp("timing_drift")),
+          d_timing_handover(0)
+    {
+      update_fi_start();
+
+      message_port_register_out(d_timing_port);
+    }
+
+    /*
+     * Our virtual destructor.
+     */
+    demod_reference_signals_impl::~demod_reference_signals_impl()
+    {
+    }
+
+    void
+    demod_reference_signals_impl::update_fi_start()
     {
       // TODO - investigate why this is happening
       if ((config.d_constellation == QAM64) && (config.d_transmission_mode == T8k))
@@ -76,10 +99,61 @@ namespace gr {
     }
 
     /*
-     * Our virtual destructor.
+     * Update config with the transmission parameters received with TPS
+     * and tell downstream blocks about them with a tag.
+     * Constellation, hierarchy and code rates are changed in place.
+     * Guard interval is changed here and sent to symbol acquisition.
+     * Transmission mode changes the FFT length and cannot be changed
+     * without a restart, it is only logged.
      */
-    demod_reference_signals_impl::~demod_reference_signals_impl()
+    void
+    demod_reference_signals_impl::process_transmission_parameters(long params)
+    {
+      if (params == d_params)
+        return;
+
+      dvbt_config rcv(config);
+      rcv.set_transmission_parameters(params);
+
+      printf("TPS: constellation: %i, hierarchy: %i, code rate HP: %i, code rate LP: %i, " \
+          "guard interval: %i, transmission mode: %i\n", rcv.d_constellation, rcv.d_hierarchy, \
+          rcv.d_code_rate_HP, rcv.d_code_rate_LP, rcv.d_guard_interval, rcv.d_transmission_mode);
+
+      if (rcv.d_transmission_mode != config.d_transmission_mode)
+        printf("TPS: transmission mode %i differs from configured one %i, restart needed\n", \
+            rcv.d_transmission_mode, config.d_transmission_mode);
+
+      if (rcv.d_guard_interval != config.d_guard_interval)
+      {
+        printf("TPS: guard interval %i differs from configured one %i, switching to it\n", \
+            rcv.d_guard_interval, config.d_guard_interval);
+
+        config.set_guard_interval(rcv.d_guard_interval);
+        d_pg.update_guard_interval();
+      }
+
+      // Symbol acquisition may run with a detected guard interval,
+      // it is told the TPS one each time parameters change
+      // (unless the FFT length is not the right one anyway)
+      if (d_timing_handover && (rcv.d_transmission_mode == config.d_transmission_mode))
+        message_port_pub(d_timing_port, pmt::cons(pmt::mp("guard_interval"), pmt::from_long(config.d_cp_length)));
+
+      config.set_constellation(rcv.d_constellation);
+      config.set_hierarchical(rcv.d_hierarchy);
+      config.set_code_rate_HP(rcv.d_code_rate_HP);
+      config.set_code_rate_LP(rcv.d_code_rate_LP);
+      update_fi_start();
+
+      d_params = params;
+      d_send_params = 1;
+    }
+
+    bool
+    demod_reference_signals_impl::start()
     {
+      d_timing_handover = !pmt::is_null(message_subscribers(d_timing_port));
+
+      return true;
     }
 
     void
@@ -101,11 +175,10 @@ namespace gr {
       gr_complex *out = (gr_complex *) output_items[0];
 
       int symbol_index, frame_index;
+      long params;
+      float drift, offset;
       int to_out = 0;
 
-      for (int i = 0; i < noutput_items; i++)
-        to_out += d_pg.parse_input(&in[i * d_ninput], &out[i * d_noutput], &symbol_index, &frame_index);
-
       /*
        * Wait for a sync_start tag from upstream that signals when to start.
        * Allways consume until to a superframe start.
@@ -113,32 +186,64 @@ namespace gr {
       if (is_sync_start(noutput_items))
         d_init = 0;
 
-      if (d_init == 0)
+      for (int i = 0; i < noutput_items; i++)
       {
-        // This is super-frame start
-        if (((symbol_index % 68) == 0) && ((frame_index % 4) == d_fi_start))
+        d_pg.parse_input(&in[i * d_ninput], &out[to_out * d_noutput], &symbol_index, &frame_index);
+
+        if (d_pg.get_transmission_parameters(&params))
+          process_transmission_parameters(params);
+
+        if (d_timing_handover && d_pg.get_timing_drift(&drift))
+          message_port_pub(d_timing_port, pmt::from_double(drift));
+
+        if (d_timing_handover && d_pg.get_carrier_offset(&offset))
+          message_port_pub(d_timing_port, pmt::cons(pmt::mp("carrier_offset"), pmt::from_double(offset)));
+
+        if (d_init == 0)
         {
-          d_init = 1;
-          printf("symbol_index: %i, frame_index: %i\n", symbol_index, frame_index);
+          // This is super-frame start
+          if (((symbol_index % 68) == 0) && ((frame_index % 4) == d_fi_start))
+          {
+            d_init = 1;
+            d_send_symbol_index = 1;
+            printf("symbol_index: %i, frame_index: %i\n", symbol_index, frame_index);
+
+            const uint64_t offset = this->nitems_written(0) + to_out;
+            pmt::pmt_t key = pmt::string_to_symbol("superframe_start");
+            pmt::pmt_t value = pmt::from_long(0xaa);
+            this->add_item_tag(0, offset, key, value);
+          }
+          else
+            continue;
+        }
 
-          const uint64_t offset = this->nitems_written(0);
-          pmt::pmt_t key = pmt::string_to_symbol("superframe_start");
-          pmt::pmt_t value = pmt::from_long(0xaa);
-          this->add_item_tag(0, offset, key, value);
+        /*
+         * Downstream blocks follow the symbol index on their own.
+         * Send a tag with the symbol index only at the start of a frame
+         * and when the index does not follow the previous one.
+         */
+        if (d_send_symbol_index || (symbol_index == 0) || \
+            (symbol_index != ((d_symbol_index + 1) % config.d_symbols_per_frame)))
+        {
+          const uint64_t offset = this->nitems_written(0) + to_out;
+          this->add_item_tag(0, offset, d_symbol_index_key, pmt::from_long(symbol_index));
+          d_send_symbol_index = 0;
         }
-        else
+
+        /*
+         * Send the transmission parameters received with TPS
+         * on the first output item after they were received or changed.
+         */
+        if (d_send_params)
         {
-          consume_each(1);
-          return (0);
+          const uint64_t offset = this->nitems_written(0) + to_out;
+          this->add_item_tag(0, offset, d_params_key, pmt::from_long(d_params));
+          d_send_params = 0;
         }
-      }
 
-      // Send a tag for each OFDM symbol informing about
-      // symbol index.
-      const uint64_t offset = this->nitems_written(0);
-      pmt::pmt_t key = pmt::string_to_symbol("symbol_index");
-      pmt::pmt_t value = pmt::from_long(symbol_index);
-      this->add_item_tag(0, offset, key, value);
+        d_symbol_index = symbol_index;
+        to_out++;
+      }
 
       // Consume from input stream
       consume_each (noutput_items);
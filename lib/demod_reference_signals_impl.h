@@ -31,7 +31,8 @@ namespace gr {
     class demod_reference_signals_impl : public demod_reference_signals
     {
       // configuration object for this class
-      const dvbt_config config;
+      // updated with the parameters received with TPS
+      dvbt_config config;
 
     private:
       // Pilot Generator object
@@ -44,7 +45,27 @@ namespace gr {
       int d_init;
       int d_fi_start;
 
+      // Symbol index of the last output item
+      int d_symbol_index;
+      // Force a symbol index tag on next output item
+      int d_send_symbol_index;
+      const pmt::pmt_t d_symbol_index_key;
+
+      // Transmission parameters received with TPS
+      long d_params;
+      // Send a transmission parameters tag on next output item
+      int d_send_params;
+      const pmt::pmt_t d_params_key;
+
+      // Sampling clock and carrier frequency offsets and the guard
+      // interval are sent upstream (to symbol acquisition) only when
+      // somebody listens, otherwise offsets are tracked here
+      const pmt::pmt_t d_timing_port;
+      int d_timing_handover;
+
       int is_sync_start(int nitems);
+      void update_fi_start();
+      void process_transmission_parameters(long params);
 
     public:
       demod_reference_signals_impl(int itemsize, int ninput, int noutput, \
@@ -54,6 +75,8 @@ namespace gr {
         dvbt_transmission_mode_t transmission_mode = gr::dvbt::T2k, int include_cell_id = 0, int cell_id = 0);
       ~demod_reference_signals_impl();
 
+      bool start();
+
       void forecast (int noutput_items, gr_vector_int &ninput_items_required);
 
       // Where all the action really happens
@@ -44,6 +44,8 @@ namespace gr {
     dvbt_config::set_constellation(dvbt_constellation_t constellation)
     {
       d_constellation = constellation; 
+      update_constellation();
+      update_norm();
     }
     dvbt_constellation_t 
     dvbt_config::get_constellation() 
@@ -54,6 +56,8 @@ namespace gr {
     dvbt_config::set_hierarchical(dvbt_hierarchy_t hierarchy)
     {
       d_hierarchy = hierarchy;
+      update_hierarchy();
+      update_norm();
     }
     dvbt_hierarchy_t
     dvbt_config::get_hierarchical()
@@ -64,11 +68,13 @@ namespace gr {
     dvbt_config::set_code_rate_HP(dvbt_code_rate_t code_rate)
     {
       d_code_rate_HP = code_rate;
+      update_code_rate();
     }
     void
     dvbt_config::set_code_rate_LP(dvbt_code_rate_t code_rate)
     {
       d_code_rate_LP = code_rate;
+      update_code_rate();
     }
     dvbt_code_rate_t
     dvbt_config::get_code_rate_HP()
@@ -81,9 +87,22 @@ namespace gr {
       return d_code_rate_LP;
     }
     void
+    dvbt_config::set_guard_interval(dvbt_guard_interval_t guard_interval)
+    {
+      d_guard_interval = guard_interval;
+      update_guard_interval();
+    }
+    dvbt_guard_interval_t
+    dvbt_config::get_guard_interval()
+    {
+      return d_guard_interval;
+    }
+    void
     dvbt_config::set_transmission_mode(dvbt_transmission_mode_t transmission_mode)
     {
       d_transmission_mode = transmission_mode;
+      update_transmission_mode();
+      update_guard_interval();
     }
     dvbt_transmission_mode_t
     dvbt_config::get_transmission_mode()
@@ -91,17 +110,36 @@ namespace gr {
       return d_transmission_mode;
     }
 
-    dvbt_config::dvbt_config(dvbt_constellation_t constellation, \
-      dvbt_hierarchy_t hierarchy, dvbt_code_rate_t code_rate_HP, \
-      dvbt_code_rate_t code_rate_LP, dvbt_guard_interval_t guard_interval, \
-      dvbt_transmission_mode_t transmission_mode, int include_cell_id, int cell_id) :
-            d_constellation(constellation), d_hierarchy(hierarchy), d_code_rate_HP(code_rate_HP),
-            d_code_rate_LP(code_rate_LP), d_guard_interval(guard_interval), d_transmission_mode(transmission_mode),
-            d_include_cell_id(include_cell_id), d_cell_id(cell_id)
+    /*
+     * Pack the transmission parameters in one word.
+     * This is used as value of transmission_parameters tags.
+     */
+    long
+    dvbt_config::get_transmission_parameters() const
     {
-      d_symbols_per_frame = 68;
-      d_frames_per_superframe = 4;
+      return (long)d_constellation | ((long)d_hierarchy << 2) \
+        | ((long)d_code_rate_HP << 5) | ((long)d_code_rate_LP << 8) \
+        | ((long)d_guard_interval << 11) | ((long)d_transmission_mode << 13);
+    }
+
+    /*
+     * Unpack the transmission parameters from one word
+     * and update all derived parameters.
+     */
+    void
+    dvbt_config::set_transmission_parameters(long params)
+    {
+      set_constellation((dvbt_constellation_t)(params & 0x3));
+      set_hierarchical((dvbt_hierarchy_t)((params >> 2) & 0x7));
+      set_code_rate_HP((dvbt_code_rate_t)((params >> 5) & 0x7));
+      set_code_rate_LP((dvbt_code_rate_t)((params >> 8) & 0x7));
+      set_transmission_mode((dvbt_transmission_mode_t)((params >> 13) & 0x3));
+      set_guard_interval((dvbt_guard_interval_t)((params >> 11) & 0x3));
+    }
 
+    void
+    dvbt_config::update_transmission_mode()
+    {
       switch (d_transmission_mode)
       {
         case gr::dvbt::T2k:
@@ -122,7 +160,11 @@ namespace gr {
       }
       d_zeros_on_left = int(ceil((d_fft_length - (d_Kmax - d_Kmin + 1)) / 2.0));
       d_zeros_on_right = d_fft_length - d_zeros_on_left - (d_Kmax - d_Kmin + 1);
+    }
 
+    void
+    dvbt_config::update_constellation()
+    {
       switch (d_constellation)
       {
         case gr::dvbt::QPSK:
@@ -146,7 +188,11 @@ namespace gr {
           d_m = 4;
           break;
       }
+    }
 
+    void
+    dvbt_config::update_code_rate()
+    {
       switch (d_code_rate_HP)
       {
         case gr::dvbt::C1_2:
@@ -159,7 +205,7 @@ namespace gr {
           d_cr_k = 3; d_cr_n = 4; d_cr_p = 3;
           break;
         case gr::dvbt::C5_6:
-          d_cr_k = 5; d_cr_k = 6; d_cr_p = 5;
+          d_cr_k = 5; d_cr_n = 6; d_cr_p = 5;
         break;
         case gr::dvbt::C7_8:
           d_cr_k = 7; d_cr_n = 8; d_cr_p = 7;
@@ -190,8 +236,12 @@ namespace gr {
           d_cr_k = 1; d_cr_n = 2;
           break;
       }
+    }
 
-      switch (guard_interval)
+    void
+    dvbt_config::update_guard_interval()
+    {
+      switch (d_guard_interval)
       {
         case gr::dvbt::G1_32:
           d_cp_length = d_fft_length / 32;
@@ -209,7 +259,11 @@ namespace gr {
           d_cp_length = d_fft_length / 32;
           break;
       }
+    }
 
+    void
+    dvbt_config::update_hierarchy()
+    {
       switch (d_hierarchy)
       {
         case (gr::dvbt::NH):
@@ -223,7 +277,11 @@ namespace gr {
         default:
           d_alpha = 1; break;
       }
+    }
 
+    void
+    dvbt_config::update_norm()
+    {
       // ETSI EN 400 744 Clause 4.4
       // Normalization factor
       switch (d_m)
@@ -249,6 +307,25 @@ namespace gr {
       }
     }
 
+    dvbt_config::dvbt_config(dvbt_constellation_t constellation, \
+      dvbt_hierarchy_t hierarchy, dvbt_code_rate_t code_rate_HP, \
+      dvbt_code_rate_t code_rate_LP, dvbt_guard_interval_t guard_interval, \
+      dvbt_transmission_mode_t transmission_mode, int include_cell_id, int cell_id) :
+            d_constellation(constellation), d_hierarchy(hierarchy), d_code_rate_HP(code_rate_HP),
+            d_code_rate_LP(code_rate_LP), d_guard_interval(guard_interval), d_transmission_mode(transmission_mode),
+            d_include_cell_id(include_cell_id), d_cell_id(cell_id)
+    {
+      d_symbols_per_frame = 68;
+      d_frames_per_superframe = 4;
+
+      update_transmission_mode();
+      update_constellation();
+      update_code_rate();
+      update_guard_interval();
+      update_hierarchy();
+      update_norm();
+    }
+
     dvbt_config::~dvbt_config()
     {
     }
@@ -26,6 +26,7 @@
 #include <gnuradio/io_signature.h>
 #include <dvbt/dvbt_config.h>
 #include "dvbt_demap_impl.h"
+#include "symbol_inner_interleaver_impl.h"
 #include <gnuradio/math.h>
 #include <stdio.h>
 #include <sys/time.h>
@@ -42,16 +43,16 @@ namespace gr {
 
     dvbt_demap::sptr
     dvbt_demap::make(int nsize, dvbt_constellation_t constellation, dvbt_hierarchy_t hierarchy, \
-        dvbt_transmission_mode_t transmission, float gain)
+        dvbt_transmission_mode_t transmission, float gain, int deinterleave)
     {
-      return gnuradio::get_initial_sptr (new dvbt_demap_impl(nsize, constellation, hierarchy, transmission, gain));
+      return gnuradio::get_initial_sptr (new dvbt_demap_impl(nsize, constellation, hierarchy, transmission, gain, deinterleave));
     }
 
     /*
      * The private constructor
      */
     dvbt_demap_impl::dvbt_demap_impl(int nsize, dvbt_constellation_t constellation, dvbt_hierarchy_t hierarchy, \
-        dvbt_transmission_mode_t transmission, float gain)
+        dvbt_transmission_mode_t transmission, float gain, int deinterleave)
       : block("dvbt_demap",
           io_signature::make(1, 1, sizeof (gr_complex) * nsize),
           io_signature::make(1, 1, sizeof (unsigned char) * nsize)),
@@ -60,7 +61,13 @@ namespace gr {
       d_constellation_size(0),
       d_step(0),
       d_alpha(0),
-      d_gain(0.0)
+      d_gain(0.0),
+      d_user_gain(gain),
+      d_deinterleave(deinterleave),
+      d_h(NULL),
+      d_symbol_index(0),
+      d_symbol_index_key(pmt::string_to_symbol("symbol_index")),
+      d_params_key(pmt::string_to_symbol("transmission_parameters"))
     {
       //Get parameters from config object
       d_constellation_size = config.d_constellation_size;
@@ -68,29 +75,47 @@ namespace gr {
       d_step = config.d_step;
       d_alpha = config.d_alpha;
       d_gain = gain * config.d_norm;
+      d_symbols_per_frame = config.d_symbols_per_frame;
+
+      if (d_deinterleave)
+      {
+        if (d_nsize != config.d_payload_length)
+        {
+          std::cout << "Error: cannot deinterleave, nsize: " << d_nsize \
+            << " payload length: " << config.d_payload_length << std::endl;
+          d_deinterleave = 0;
+        }
+        else
+          d_h = symbol_inner_interleaver_impl::H_table(d_transmission_mode);
+      }
 
       printf("DVBT demap, d_constellation_size: %i\n", d_constellation_size);
       printf("DVBT demap, d_step: %i\n", d_step);
       printf("DVBT demap, d_alpha: %i\n", d_alpha);
       printf("DVBT demap, d_gain: %f\n", d_gain);
+      printf("DVBT demap, d_deinterleave: %i\n", d_deinterleave);
 
       const int alignment_multiple = volk_get_alignment() / sizeof(unsigned char);
       set_alignment(std::max(1, alignment_multiple));
 
       const int alignment = volk_get_alignment();
 
+      // Allocate for the largest constellation (QAM64) since
+      // the constellation can change with transmission parameters
+      const int max_constellation_size = 64;
+
 #ifdef USE_POSIX_MEMALIGN
-      if (posix_memalign((void **)&d_constellation_points, alignment, sizeof(gr_complex) * d_constellation_size))
+      if (posix_memalign((void **)&d_constellation_points, alignment, sizeof(gr_complex) * max_constellation_size))
         std::cout << "cannot allocate memory: d_constellation_points" << std::endl;
 
-      if (posix_memalign((void **)&d_sq_dist, alignment, sizeof(float) * d_constellation_size))
+      if (posix_memalign((void **)&d_sq_dist, alignment, sizeof(float) * max_constellation_size))
         std::cout << "cannot allocate memory: d_sq_dist" << std::endl;
 #else
-      d_constellation_points = new gr_complex[d_constellation_size];
+      d_constellation_points = new gr_complex[max_constellation_size];
       if (d_constellation_points == NULL)
         std::cout << "cannot allocate d_constellation_points" << std::endl;
 
-      d_sq_dist = new float[d_constellation_size];
+      d_sq_dist = new float[max_constellation_size];
       if (d_sq_dist == NULL)
         std::cout << "cannot allocate d_sq_dist" << std::endl;
 #endif
@@ -206,6 +231,60 @@ namespace gr {
       return (val >> 1) ^ val;
     }
 
+    /*
+     * Change constellation and hierarchy to the ones received
+     * with a transmission_parameters tag.
+     */
+    void
+    dvbt_demap_impl::set_transmission_parameters(long params)
+    {
+      dvbt_config rcv(config);
+      rcv.set_transmission_parameters(params);
+
+      if (rcv.d_transmission_mode != config.d_transmission_mode)
+        printf("DVBT demap, transmission mode changed to %i, restart needed\n", rcv.d_transmission_mode);
+
+      if ((rcv.d_constellation == config.d_constellation) && (rcv.d_hierarchy == config.d_hierarchy))
+        return;
+
+      config.set_constellation(rcv.d_constellation);
+      config.set_hierarchical(rcv.d_hierarchy);
+
+      d_constellation_size = config.d_constellation_size;
+      d_step = config.d_step;
+      d_alpha = config.d_alpha;
+      d_gain = d_user_gain * config.d_norm;
+
+      printf("DVBT demap, d_constellation_size: %i\n", d_constellation_size);
+      printf("DVBT demap, d_alpha: %i\n", d_alpha);
+
+      make_constellation_points(d_constellation_size, d_step, d_alpha);
+    }
+
+    void
+    dvbt_demap_impl::demap_symbol(const gr_complex * in, unsigned char * out)
+    {
+      if (d_deinterleave)
+      {
+        // Demap in symbol deinterleaved order
+        if (d_symbol_index % 2)
+        {
+          for (int q = 0; q < d_nsize; q++)
+            out[d_h[q]] = find_constellation_value(in[q]);
+        }
+        else
+        {
+          for (int q = 0; q < d_nsize; q++)
+            out[q] = find_constellation_value(in[d_h[q]]);
+        }
+      }
+      else
+      {
+        for (int q = 0; q < d_nsize; q++)
+          out[q] = find_constellation_value(in[q]);
+      }
+    }
+
     void
     dvbt_demap_impl::forecast (int noutput_items, gr_vector_int &ninput_items_required)
     {
@@ -225,8 +304,44 @@ namespace gr {
 
         //gettimeofday(&tvs, &tzs);
 
-        for (int i = 0; i < (noutput_items * d_nsize); i++)
-          out[i] = find_constellation_value(in[i]);
+        const uint64_t nread = this->nitems_read(0); //number of items read on port 0
+
+        // Demod reference signals sends a symbol index tag at the
+        // start of each frame and when the index jumps.
+        if (d_deinterleave)
+          this->get_tags_in_range(d_tags, 0, nread, nread + noutput_items, d_symbol_index_key);
+
+        // Demod reference signals sends the transmission parameters
+        // received with TPS when they change.
+        this->get_tags_in_range(d_params_tags, 0, nread, nread + noutput_items, d_params_key);
+
+        for (int k = 0, t = 0, p = 0; k < noutput_items; k++)
+        {
+          // New constellation starts with this item
+          while ((p < (int)d_params_tags.size()) && (d_params_tags[p].offset == (nread + k)))
+          {
+            set_transmission_parameters(pmt::to_long(d_params_tags[p].value));
+            p++;
+          }
+
+          if (d_deinterleave)
+          {
+            // Take the symbol index from a tag if there is one on
+            // this item, otherwise it follows the previous one.
+            if ((t < (int)d_tags.size()) && (d_tags[t].offset == (nread + k)))
+            {
+              d_symbol_index = pmt::to_long(d_tags[t].value);
+
+              // Skip duplicated tags on the same item
+              while ((t < (int)d_tags.size()) && (d_tags[t].offset == (nread + k)))
+                t++;
+            }
+            else if (k || nread)
+              d_symbol_index = (d_symbol_index + 1) % d_symbols_per_frame;
+          }
+
+          demap_symbol(&in[k * d_nsize], &out[k * d_nsize]);
+        }
 
         //gettimeofday(&tve, &tze);
         //printf("dvbt demap: us: %f\n", (float) (tve.tv_usec - tvs.tv_usec) / (float) (noutput_items * d_nsize));
@@ -34,11 +34,13 @@ namespace gr {
      * \param hierarchy hierarchy used \n
      * \param transmission transmission mode used \n
      * \param gain gian of complex output stream \n
+     * \param deinterleave do symbol deinterleaving as well \n
      */
     class dvbt_demap_impl : public dvbt_demap
     {
     private:
-      const dvbt_config config;
+      // updated from transmission parameters tags
+      dvbt_config config;
 
       int d_nsize;
 
@@ -52,6 +54,22 @@ namespace gr {
       unsigned char d_alpha;
       //Gain for the complex values
       float d_gain;
+      //Gain requested by user (without normalization)
+      float d_user_gain;
+
+      //Symbol deinterleaving done here
+      int d_deinterleave;
+      //Symbol deinterleaver permutation (H function)
+      const int * d_h;
+      int d_symbols_per_frame;
+      //Keeps the symbol index
+      int d_symbol_index;
+      //Symbol index tags read in one call
+      std::vector<tag_t> d_tags;
+      const pmt::pmt_t d_symbol_index_key;
+      //Transmission parameters tags read in one call
+      std::vector<tag_t> d_params_tags;
+      const pmt::pmt_t d_params_key;
 
       gr_complex * d_constellation_points;
       float * d_sq_dist;
@@ -59,9 +77,11 @@ namespace gr {
       void make_constellation_points(int size, int step, int alpha);
       int find_constellation_value(gr_complex val);
       int bin_to_gray(int val);
+      void set_transmission_parameters(long params);
+      void demap_symbol(const gr_complex * in, unsigned char * out);
 
     public:
-      dvbt_demap_impl(int nsize, dvbt_constellation_t constellation, dvbt_hierarchy_t hierarchy, dvbt_transmission_mode_t transmission, float gain);
+      dvbt_demap_impl(int nsize, dvbt_constellation_t constellation, dvbt_hierarchy_t hierarchy, dvbt_transmission_mode_t transmission, float gain, int deinterleave);
       ~dvbt_demap_impl();
 
       void forecast (int noutput_items, gr_vector_int &ninput_items_required);
@@ -75,6 +95,7 @@ namespace gr {
        * 000000Y0Y1 - QAM4 \n
        * 0000Y0Y1Y2Y3 - QAM16 \n
        * 00Y0Y1Y2Y3Y4Y5 - QAM64 \n
+       * When deinterleaving the output is in symbol deinterleaved order. \n
        */
       int general_work(int noutput_items,
            gr_vector_int &ninput_items,
@@ -71,7 +71,7 @@ namespace gr {
         std::cout << "cannot allocate d_constellation_points" << std::endl;
       }
 
-      make_constellation_points(d_constellation_size, d_step, d_alpha);
+      make_constellation_points(d_constellation_points, d_constellation_size, d_step, d_alpha, d_gain);
     }
 
     /*
@@ -89,7 +89,7 @@ namespace gr {
     }
 
     void
-    dvbt_map_impl::make_constellation_points(int size, int step, int alpha)
+    dvbt_map_impl::make_constellation_points(gr_complex * points, int size, int step, int alpha, float gain)
     {
       //TODO - verify if QPSK works
       
@@ -134,7 +134,7 @@ namespace gr {
 
         // Keep corespondence symbol bits->complex symbol in one vector
         // Norm the signal using gain
-        d_constellation_points[val] = d_gain * gr_complex(sign0 * xval, sign1 * yval);
+        points[val] = gain * gr_complex(sign0 * xval, sign1 * yval);
       }
     }
 
@@ -55,16 +55,21 @@ namespace gr {
 
       gr_complex * d_constellation_points;
 
-      void make_constellation_points(int size, int step, int alpha);
       gr_complex find_constellation_point(int val);
 
       //Return gray representation from natural binary
-      unsigned int bin_to_gray(unsigned int val);
+      static unsigned int bin_to_gray(unsigned int val);
 
     public:
       dvbt_map_impl(int nsize, dvbt_constellation_t constellation, dvbt_hierarchy_t hierarchy, dvbt_transmission_mode_t transmission, float gain);
       ~dvbt_map_impl();
 
+      /*!
+       * Fill points (size entries) with the constellation points
+       * indexed by symbol bits, scaled with gain. \n
+       */
+      static void make_constellation_points(gr_complex * points, int size, int step, int alpha, float gain);
+
       void forecast (int noutput_items, gr_vector_int &ninput_items_required);
       /*!
         * ETSI EN 300 744 Clause 4.3.5. \n
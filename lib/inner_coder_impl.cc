@@ -26,6 +26,7 @@
 #include "inner_coder_impl.h"
 #include <stdio.h>
 #include <assert.h>
+#include <string.h>
 
 namespace gr {
   namespace dvbt {
@@ -61,77 +62,99 @@ namespace gr {
                         (d_reg >> 1) ^ d_reg) & 0x1;
     }
 
-    //TODO - do this based on puncturing matrix
     /*
-     * Input e.g rate 2/3:
-     * 000000x0x1
-     * Output e.g. rate 2/3
-     * 00000c0c1c2
+     * Encode all 8 bits input words from all states at once.
      */
     void
-    inner_coder_impl::generate_punctured_code(dvbt_code_rate_t coderate, unsigned char * in, unsigned char * out)
+    inner_coder_impl::build_encoder_table()
     {
-      int x, y;
+      for (int state = 0; state < 64; state++)
+      {
+        for (int byte = 0; byte < 256; byte++)
+        {
+          int x, y;
+          uint32_t code = 0;
+
+          // State is on bits 6-1 of the register after a bit
+          d_reg = state << 1;
+
+          for (int j = 0; j < 8; j++)
+          {
+            generate_codeword((byte >> (7 - j)) & 1, x, y);
+            code = (code << 2) | (x << 1) | y;
+          }
+
+          d_enc_table[(state << 8) | byte] = code | (((d_reg >> 1) & 0x3f) << 16);
+        }
+      }
+
+      d_reg = 0;
+    }
+
+    /*
+     * Puncturing patterns on mother code X1Y1X2Y2...
+     * Rate 2/3: X1Y1Y2
+     * Rate 3/4: X1Y1Y2X3
+     * Rate 5/6: X1Y1Y2X3Y4X5
+     * Rate 7/8: X1Y1Y2Y3Y4X5Y6X7
+     * A puncturing period is 2k bits, so 8 bits chunks of mother code
+     * start on 2k / gcd(8, 2k) positions of the pattern. For each of them
+     * there is a table that extracts (and packs) the bits kept.
+     */
+    void
+    inner_coder_impl::build_puncturing_tables(dvbt_code_rate_t coderate)
+    {
+      const char * pattern;
 
       switch(coderate)
       {
-        //X1Y1
-        case gr::dvbt::C1_2:
-          generate_codeword(in[0], x, y);
-          out[0] = x; out[1] = y;
-          break;
-        //X1Y1Y2
         case gr::dvbt::C2_3:
-          generate_codeword(in[0], x, y);
-          out[0] = x; out[1] = y;
-          generate_codeword(in[1], x, y);
-          out[2] = y;
+          pattern = "1101";
           break;
-        //X1Y1Y2X3
         case gr::dvbt::C3_4:
-          generate_codeword(in[0], x, y);
-          out[0] = x; out[1] = y;
-          generate_codeword(in[1], x, y);
-          out[2] = y;
-          generate_codeword(in[2], x, y);
-          out[3] = x;
+          pattern = "110110";
           break;
-        //X1Y1Y2X3Y4X5
         case gr::dvbt::C5_6:
-          generate_codeword(in[0], x, y);
-          out[0] = x; out[1] = y;
-          generate_codeword(in[1], x, y);
-          out[2] = y;
-          generate_codeword(in[2], x, y);
-          out[3] = x;
-          generate_codeword(in[3], x, y);
-          out[4] = y;
-          generate_codeword(in[4], x, y);
-          out[5] = x;
+          pattern = "1101100110";
           break;
-        //X1Y1Y2X3Y4X5Y6X7
         case gr::dvbt::C7_8:
-          generate_codeword(in[0], x, y);
-          out[0] = x; out[1] = y;
-          generate_codeword(in[1], x, y);
-          out[2] = y;
-          generate_codeword(in[2], x, y);
-          out[3] = y;
-          generate_codeword(in[3], x, y);
-          out[4] = y;
-          generate_codeword(in[4], x, y);
-          out[5] = x;
-          generate_codeword(in[5], x, y);
-          out[6] = y;
-          generate_codeword(in[6], x, y);
-          out[7] = x;
+          pattern = "11010101100110";
           break;
+        case gr::dvbt::C1_2:
         default:
-          generate_codeword(in[0], x, y);
-          out[0] = x; out[1] = y;
+          pattern = "11";
           break;
       }
 
+      const int period = strlen(pattern);
+
+      d_punct_phases = 0;
+
+      for (int offset = 0; ; offset = (offset + 8) % period)
+      {
+        if ((offset == 0) && d_punct_phases)
+          break;
+
+        const int p = d_punct_phases++;
+
+        d_punct_count[p] = 0;
+
+        for (int i = 0; i < 8; i++)
+          d_punct_count[p] += pattern[(offset + i) % period] == '1';
+
+        for (int v = 0; v < 256; v++)
+        {
+          unsigned char bits = 0;
+
+          for (int i = 0; i < 8; i++)
+          {
+            if (pattern[(offset + i) % period] == '1')
+              bits = (bits << 1) | ((v >> (7 - i)) & 1);
+          }
+
+          d_punct_lut[p][v] = bits;
+        }
+      }
     }
 
     inner_coder::sptr
@@ -153,7 +176,8 @@ namespace gr {
       config(constellation, hierarchy, coderate, coderate),
       d_ninput(ninput), d_noutput(noutput),
       d_reg(0),
-      d_bitcount(0)
+      d_bitcount(0),
+      d_state(0)
     {
       //Determine k - input of encoder
       d_k = config.d_cr_k;
@@ -193,18 +217,16 @@ namespace gr {
       d_in_bs = (d_k * d_m) / 2;
       d_out_bs = 4 * d_n;
 
-      // allocate bit buffers
-      d_in_buff = new unsigned char[8 * d_in_bs];
-      if (d_in_buff == NULL)
+      // allocate encoder table
+      d_enc_table = new uint32_t[64 * 256];
+      if (d_enc_table == NULL)
       {
-        std::cout << "Error allocating d_in_buff" << std::endl;
+        std::cout << "Error allocating d_enc_table" << std::endl;
+        return;
       }
 
-      d_out_buff = new unsigned char[8 * d_in_bs * d_n / d_k];
-      if (d_in_buff == NULL)
-      {
-        std::cout << "Error allocating d_out_buff" << std::endl;
-      }
+      build_encoder_table();
+      build_puncturing_tables(config.d_code_rate_HP);
     }
 
     /*
@@ -212,8 +234,7 @@ namespace gr {
      */
     inner_coder_impl::~inner_coder_impl()
     {
-      delete [] d_out_buff;
-      delete [] d_in_buff;
+      delete [] d_enc_table;
     }
 
     void
@@ -227,6 +248,41 @@ namespace gr {
        }
     }
 
+    void
+    inner_coder_impl::encode_block(const unsigned char * in, unsigned char * out)
+    {
+      const unsigned int mask = (1 << d_m) - 1;
+
+      // A block holds whole puncturing periods and output symbols
+      // so puncturing phase and bit accumulator start over
+      int phase = 0;
+      unsigned int acc = 0;
+      int nacc = 0;
+
+      for (int i = 0; i < d_in_bs; i++)
+      {
+        // Encode a byte
+        uint32_t code = d_enc_table[(d_state << 8) | in[i]];
+        d_state = code >> 16;
+
+        // Puncture both halves and pack d_m bits in one output byte
+        for (int h = 8; h >= 0; h -= 8)
+        {
+          acc = (acc << d_punct_count[phase]) | d_punct_lut[phase][(code >> h) & 0xff];
+          nacc += d_punct_count[phase];
+
+          if (++phase == d_punct_phases)
+            phase = 0;
+
+          while (nacc >= d_m)
+          {
+            nacc -= d_m;
+            *out++ = (acc >> nacc) & mask;
+          }
+        }
+      }
+    }
+
     int
     inner_coder_impl::general_work (int noutput_items,
                        gr_vector_int &ninput_items,
@@ -237,35 +293,7 @@ namespace gr {
         unsigned char *out = (unsigned char *) output_items[0];
 
         for (int k = 0; k < (noutput_items * d_noutput / d_out_bs); k++)
-        {
-          // Unpack input to bits
-          for (int i = 0; i < d_in_bs; i++)
-          {
-            for (int j = 0; j < 8; j++)
-            {
-              d_in_buff[8*i + j] = (in[k*d_in_bs + i] >> (7 - j)) & 1;
-            }
-            //printf("in[%i]: %x\n", k*d_in_bs + i, in[k*d_in_bs + i]);
-          }
-
-
-          // Encode the data
-          for (int in_bit = 0, out_bit = 0; in_bit < (8 * d_in_bs); in_bit += d_k, out_bit += d_n)
-            generate_punctured_code(config.d_code_rate_HP, &d_in_buff[in_bit], &d_out_buff[out_bit]);
-
-          // Pack d_m bit in one output byte
-          for (int i = 0; i < d_out_bs; i++)
-          {
-            unsigned char c = 0;
-
-            for (int j = 0; j < d_m; j++)
-              c |= d_out_buff[d_m*i + j] << (d_m - 1 - j);
-
-            out[k*d_out_bs + i] = c;
-
-            //printf("out[%i]: %x\n", k*d_out_bs + i, out[k*d_out_bs + i]);
-          }
-        }
+          encode_block(&in[k * d_in_bs], &out[k * d_out_bs]);
 
         // Tell runtime system how many input items we consumed on
         // each input stream.
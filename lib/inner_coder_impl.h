@@ -23,6 +23,7 @@
 
 #include <dvbt/inner_coder.h>
 #include <dvbt/dvbt_config.h>
+#include <stdint.h>
 
 namespace gr {
   namespace dvbt {
@@ -57,20 +58,37 @@ namespace gr {
 
       // input block size in bytes
       int d_in_bs;
-      // bit input buffer
-      unsigned char * d_in_buff;
 
       // output block size in bytes
       int d_out_bs;
-      // bit output buffer
-      unsigned char * d_out_buff;
 
-      void generate_codeword(unsigned char in, int &x, int &y);
-      void generate_punctured_code(dvbt_code_rate_t coderate, unsigned char * in, unsigned char * out);
+      // Encoder state (last 6 input bits, last one on MSB)
+      int d_state;
+      // Encoder table, for each state and input byte:
+      // 16 mother code bits (X0Y0...X7Y7, X0 on MSB) and next state
+      uint32_t * d_enc_table;
+
+      // Puncturing is done on 8 bits chunks of mother code.
+      // Puncturing pattern starts on a different position for each chunk
+      // of a puncturing period, there are up to 7 different ones.
+      int d_punct_phases;
+      int d_punct_count[7];
+      unsigned char d_punct_lut[7][256];
+
+      void build_encoder_table();
+      void build_puncturing_tables(dvbt_code_rate_t coderate);
 
     public:
       inner_coder_impl(int ninput, int noutput, dvbt_constellation_t constellation, dvbt_hierarchy_t hierarchy, dvbt_code_rate_t coderate);
       ~inner_coder_impl();
+
+      // Mother code output x (G1) and y (G2) for one input bit
+      void generate_codeword(unsigned char in, int &x, int &y);
+
+      // Encode, puncture and pack one block: d_in_bs input bytes
+      // to d_out_bs output symbols. Encoder state is kept between blocks.
+      void encode_block(const unsigned char * in, unsigned char * out);
+
       void forecast (int noutput_items, gr_vector_int &ninput_items_required);
       /*!
        * ETSI EN 300 744 Clause 4.3.3. \n
@@ -28,8 +28,10 @@
 #include <gnuradio/math.h>
 #include <gnuradio/expj.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
 #include <volk/volk.h>
-#include <gnuradio/fxpt.h>
+#include <boost/bind.hpp>
 
 //#define DEBUG 1
 
@@ -58,6 +60,26 @@ void print_double(float d)
 namespace gr {
   namespace dvbt {
 
+    // One 8k symbol with guard interval 1/4 and the next FFT length
+    const int ofdm_sym_acquisition_impl::d_detect_length = 2 * 8192 + 8192 / 4;
+    const int ofdm_sym_acquisition_impl::d_track_search = 8;
+    const int ofdm_sym_acquisition_impl::d_coarse_decimation = 8;
+    // Min correlation coefficient (as a fraction of rho) of a detected CP
+    const float ofdm_sym_acquisition_impl::d_detect_min_coef = 0.5;
+    // Gain of CP peak offset on predicted timing (samples per symbol)
+    const float ofdm_sym_acquisition_impl::d_timing_gain = 0.05;
+    // Symbols with CP peak more than 1 sample away to re-anchor timing
+    const int ofdm_sym_acquisition_impl::d_timing_slip_symbols = 4;
+
+    /*
+     * Round size up to a multiple of alignment
+     */
+    static int
+    align_size(int size, int alignment)
+    {
+      return ((size + alignment - 1) / alignment) * alignment;
+    }
+
     int 
     ofdm_sym_acquisition_impl::peak_detect_init(float threshold_factor_rise, float threshold_factor_fall, int look_ahead, float alpha)
     {
@@ -69,11 +91,62 @@ namespace gr {
       return (0);
     }
 
+    /*
+     * Find the peaks of datain with a rise/fall hysteresis on
+     * a running average (kept from one call to the next).
+     * A peak starts when datain rises above the average by the rise factor
+     * and ends when it falls below it by the fall factor. A peak that does
+     * not end inside datain is dropped.
+     * The largest of the peaks is on peak_pos.
+     * Returns non zero if a peak was found.
+     */
     int 
-    ofdm_sym_acquisition_impl::peak_detect_process(const float * datain, const int datain_length, int * peak_pos, int * peak_max)
+    ofdm_sym_acquisition_impl::peak_detect_process(const float * datain, const int datain_length, int * peak_pos)
     {
+      // The running average takes each sample once whatever the state is,
+      // so the thresholds of all samples are known before the state machine
+      for (int i = 0; i < datain_length; i++)
+      {
+        d_peak_rise[i] = d_avg;
+        d_avg = d_avg_alpha * datain[i] + (1 - d_avg_alpha) * d_avg;
+      }
+
+      unsigned int index = 0;
+
+#ifdef USE_VOLK
+      volk_32f_s32f_multiply_32f(&d_peak_fall[0], &d_peak_rise[0], d_threshold_factor_fall, datain_length);
+      volk_32f_s32f_multiply_32f(&d_peak_rise[0], &d_peak_rise[0], d_threshold_factor_rise, datain_length);
+      volk_32f_index_max_16u(&index, datain, datain_length);
+#else
+      for (int i = 0; i < datain_length; i++)
+      {
+        d_peak_fall[i] = d_peak_rise[i] * d_threshold_factor_fall;
+        d_peak_rise[i] *= d_threshold_factor_rise;
+
+        if (datain[i] > datain[index])
+          index = i;
+      }
+#endif
+
+      // The largest sample is the peak of peaks when it is above the
+      // rise threshold (it starts a peak or it is the top of one)
+      // and its peak ends inside datain
+      if (datain[index] > d_peak_rise[index])
+      {
+        for (int i = index + 1; i < datain_length; i++)
+        {
+          if (datain[i] <= d_peak_fall[i])
+          {
+            *peak_pos = index;
+            return (1);
+          }
+        }
+      }
+
+      // Otherwise run the state machine on the thresholds
       int state = 0;
       float peak_val = -(float)INFINITY; int peak_index = 0; int peak_pos_length = 0;
+      float max = -(float)INFINITY;
 
       int i = 0;
 
@@ -81,17 +154,10 @@ namespace gr {
       {
         if (state == 0)
         {
-          if (datain[i] > d_avg * d_threshold_factor_rise)
-          {
-            //printf("state 0, rise: datain: %f, d_avg: %f, d_threshold_factor_rise: %f\n", datain[i], d_avg, d_threshold_factor_rise);
+          if (datain[i] > d_peak_rise[i])
             state = 1;
-          }
           else
-          {
-            d_avg = d_avg_alpha * datain[i] + (1 - d_avg_alpha) * d_avg;
-            //printf("state 0: %i, avg: %f\n", i, d_avg);
             i++;
-          }
         } 
         else if (state == 1)
         {
@@ -99,20 +165,19 @@ namespace gr {
           {
             peak_val = datain[i];
             peak_index = i;
-            //printf("state 1, index: %i, peak_val: %f, peak_index: %i, avg: %f, dtain: %f\n", i, peak_val, peak_index, d_avg, datain[i]);
-            d_avg = d_avg_alpha * datain[i] + (1 - d_avg_alpha) * d_avg;
             i++;
           }
-          else if (datain[i] > d_avg * d_threshold_factor_fall)
-          {
-            //printf("state 1, fall: %i, avg: %f, datain: %f\n", i, d_avg, datain[i]);
-            d_avg = (d_avg_alpha) * datain[i] + (1 - d_avg_alpha) * d_avg;
+          else if (datain[i] > d_peak_fall[i])
             i++;
-          }
           else
           {
-            peak_pos[peak_pos_length] = peak_index;
-            //printf("state 1, finish: %i, peak_pos[%i]: %i\n", i, peak_pos_length, peak_pos[peak_pos_length]);
+            // Keep the peak of peaks only
+            if (peak_val > max)
+            {
+              max = peak_val;
+              *peak_pos = peak_index;
+            }
+
             peak_pos_length++;
             state = 0;
             peak_val = - (float)INFINITY;
@@ -120,33 +185,439 @@ namespace gr {
         }
       }
 
-      // Find peak of peaks
-      if (peak_pos_length)
+      return (peak_pos_length);
+    }
+
+    /*
+     * Moving sum over len samples: y[k] = x[k] + ... + x[k + len - 1]
+     * x must have (size + len - 1) samples.
+     * The sum is updated with one sample in and one out and it is
+     * computed again from scratch each len samples to avoid
+     * accumulating rounding errors.
+     */
+    void
+    ofdm_sym_acquisition_impl::moving_sum(const gr_complex * x, int len, int size, gr_complex * y)
+    {
+      gr_complex sum = 0.0;
+
+      for (int k = 0; k < size; k++)
+      {
+        if ((k % len) == 0)
+        {
+          sum = 0.0;
+
+          for (int j = 0; j < len; j++)
+            sum += x[k + j];
+        }
+        else
+          sum += x[k + len - 1] - x[k - 1];
+
+        y[k] = sum;
+      }
+    }
+
+    void
+    ofdm_sym_acquisition_impl::moving_sum(const float * x, int len, int size, float * y)
+    {
+      float sum = 0.0;
+
+      for (int k = 0; k < size; k++)
       {
-        float max = datain[peak_pos[0]];
-        int maxi = 0;
+        if ((k % len) == 0)
+        {
+          sum = 0.0;
 
-        for (int i = 1; i < peak_pos_length; i++)
+          for (int j = 0; j < len; j++)
+            sum += x[k + j];
+        }
+        else
+          sum += x[k + len - 1] - x[k - 1];
+
+        y[k] = sum;
+      }
+    }
+
+    /*
+     * Blind detection of transmission mode and guard interval.
+     * The CP correlation is evaluated for 2k/8k and all guard intervals
+     * on the same input window (d_detect_length samples).
+     * Norm is shared by all hypotheses, the correlation products
+     * by all guard intervals of a mode.
+     * The correlation coefficient |gamma| / (phi / 2) is used to compare
+     * hypotheses. A guard interval shorter than the real one gives the same
+     * coefficient, so the longest one close to the best is taken.
+     * Noise alone gives a coefficient around 1/sqrt(CP length), a CP
+     * gives rho, so the best one must reach a fraction of rho.
+     * Returns 1 if a CP was found.
+     */
+    int
+    ofdm_sym_acquisition_impl::detect_mode_guard(const gr_complex * in, int * fft_length, int * cp_length)
+    {
+      const int modes[2] = {2048, 8192};
+      const int guards[4] = {4, 8, 16, 32};
+      float coef[2][4];
+      float best = 0.0;
+      int best_mode = 0;
+
+      // Norm is the same for all hypotheses
+#ifdef USE_VOLK
+      volk_32fc_magnitude_squared_32f_u(&d_norm[0], &in[0], d_detect_length);
+#else
+      for (int i = 0; i < d_detect_length; i++)
+        d_norm[i] = std::norm(in[i]);
+#endif
+
+      for (int m = 0; m < 2; m++)
+      {
+        int N = modes[m];
+        int size = d_detect_length - N;
+
+        // Correlation products and energy for this FFT length
+        // d_corr[i] = in[i + N] * conj(in[i])
+        // d_lambda[i] = norm[i] + norm[i + N]
+#ifdef USE_VOLK
+        volk_32fc_x2_multiply_conjugate_32fc_u(&d_corr[0], &in[N], &in[0], size);
+        volk_32f_x2_add_32f_u(&d_lambda[0], &d_norm[0], &d_norm[N], size);
+#else
+        for (int i = 0; i < size; i++)
         {
-          if (datain[peak_pos[i]] > max)
+          d_corr[i] = in[i + N] * std::conj(in[i]);
+          d_lambda[i] = d_norm[i] + d_norm[i + N];
+        }
+#endif
+
+        for (int g = 0; g < 4; g++)
+        {
+          int G = N / guards[g];
+          int npos = size - G + 1;
+
+          moving_sum(&d_corr[0], G, npos, &d_gamma[0]);
+          moving_sum(&d_lambda[0], G, npos, &d_phi[0]);
+
+          float max = 0.0;
+
+          for (int k = 0; k < npos; k++)
           {
-            max = datain[peak_pos[i]];
-            maxi = i;
+            float c = 2.0 * std::abs(d_gamma[k]) / (d_phi[k] + 1e-20);
+
+            if (c > max)
+              max = c;
           }
+
+          coef[m][g] = max;
+
+          if (max > best)
+          {
+            best = max;
+            best_mode = m;
+          }
+
+          PRINTF("OFDM sym acq: detect, fft_length: %i, cp_length: %i, coef: %f\n", N, G, max);
         }
+      }
 
-        *peak_max = maxi;
-#if 0
-      for (int i = 0; i < peak_pos_length; i++)
-        printf("peak_pos[%i]: %i, lambda[%i]: %f\n", i, peak_pos[i], i, datain[peak_pos[i]]);
+      if (modes[best_mode] != d_fft_length)
+      {
+        printf("OFDM sym acq: detected fft_length %i differs from configured one %i, restart needed\n", \
+            modes[best_mode], d_fft_length);
+
+        best_mode = (d_fft_length == modes[0]) ? 0 : 1;
+        best = 0.0;
+
+        for (int g = 0; g < 4; g++)
+          best = std::max(best, coef[best_mode][g]);
+      }
+
+      // Longest guard interval close to the best
+      *fft_length = modes[best_mode];
+      *cp_length = *fft_length / guards[3];
+
+      for (int g = 0; g < 4; g++)
+      {
+        if (coef[best_mode][g] >= 0.75 * best)
+        {
+          *cp_length = *fft_length / guards[g];
+          break;
+        }
+      }
+
+      return (best >= d_detect_min_coef * d_rho);
+    }
+
+    /*
+     * Advance derotation phase over n samples.
+     * Phase increment changes to d_nextphaseinc on d_nextpos
+     * if use_nextpos is set.
+     */
+    void
+    ofdm_sym_acquisition_impl::advance_phase(int n, int use_nextpos)
+    {
+      double phase = d_phase;
+
+      if (use_nextpos && (d_nextpos >= 0) && (d_nextpos < n))
+      {
+        phase += d_nextpos * d_phaseinc;
+        d_phaseinc = d_nextphaseinc;
+        phase += (n - d_nextpos) * d_phaseinc;
+      }
+      else
+        phase += n * d_phaseinc;
+
+      d_phase = remainder(phase, 2.0 * M_PI);
+    }
+
+    /*
+     * Multiply n samples with a phasor starting at phase and
+     * advancing with phaseinc for each sample.
+     */
+    void
+    ofdm_sym_acquisition_impl::rotate(const gr_complex * in, gr_complex * out, double phase, double phaseinc, int n)
+    {
+      gr_complex phasor = gr_expj(phase);
+      const gr_complex phasor_inc = gr_expj(phaseinc);
+
+#ifdef USE_VOLK
+      volk_32fc_s32fc_x2_rotator_32fc(out, in, phasor_inc, &phasor, n);
+#else
+      for (int i = 0; i < n; i++)
+      {
+        out[i] = phasor * in[i];
+        phasor *= phasor_inc;
+
+        // Keep the phasor on the unit circle
+        if ((i & 511) == 511)
+          phasor /= std::abs(phasor);
+      }
 #endif
+    }
+
+    /*
+     * Derotate fft_length samples starting with the current phase.
+     * The first sample is rotated with d_phase + d_phaseinc.
+     * If the FFT is done here it is done on the derotated samples,
+     * in place on out if it has the alignment of the FFT plan.
+     */
+    void
+    ofdm_sym_acquisition_impl::derotate(const gr_complex * in, gr_complex * out)
+    {
+      int in_place = d_fft_buf && \
+        (fftwf_alignment_of((float *)out) == fftwf_alignment_of((float *)d_fft_buf));
+      gr_complex * dst = (d_fft_buf && !in_place) ? d_fft_buf : out;
+      int split = d_fft_length;
+
+      if ((d_nextpos >= 0) && (d_nextpos < d_fft_length))
+        split = d_nextpos;
+
+      rotate(in, dst, d_phase + d_phaseinc, d_phaseinc + d_fft_shift, split);
+
+      if (split < d_fft_length)
+        rotate(&in[split], &dst[split], d_phase + split * (d_phaseinc + d_fft_shift) + d_nextphaseinc, \
+            d_nextphaseinc + d_fft_shift, d_fft_length - split);
+
+      if (d_fft_buf)
+      {
+        fftwf_execute_dft(d_fft_plan, (fftwf_complex *)dst, (fftwf_complex *)dst);
+
+        if (!in_place)
+          memcpy(out, d_fft_buf, sizeof(gr_complex) * d_fft_length);
       }
+    }
 
-      return (peak_pos_length);
+    /*
+     * Messages from demodulator. Offsets were not corrected yet,
+     * so they add to the current ones:
+     * - a real is the drift of the symbol start (samples per symbol)
+     * - a ("carrier_offset" . real) pair is the carrier frequency
+     *   offset (subcarrier spacings)
+     * - a ("guard_interval" . integer) pair is the CP length received
+     *   with TPS, it replaces the configured or detected one
+     */
+    void
+    ofdm_sym_acquisition_impl::timing_drift_msg(pmt::pmt_t msg)
+    {
+      if (pmt::is_pair(msg) && pmt::eq(pmt::car(msg), pmt::mp("guard_interval")) \
+          && pmt::is_integer(pmt::cdr(msg)))
+      {
+        set_guard_interval(pmt::to_long(pmt::cdr(msg)));
+        return;
+      }
+
+      if (pmt::is_pair(msg) && pmt::eq(pmt::car(msg), pmt::mp("carrier_offset")) \
+          && pmt::is_real(pmt::cdr(msg)))
+      {
+        d_cfo += pmt::to_double(pmt::cdr(msg));
+
+        // CP estimation is good up to half a subcarrier spacing
+        d_cfo = std::max(-0.5, std::min(0.5, d_cfo));
+
+        PRINTF("OFDM sym acq: carrier offset: %.10f, cfo: %.10f\n", pmt::to_double(pmt::cdr(msg)), d_cfo);
+        return;
+      }
+
+      if (!pmt::is_real(msg))
+        return;
+
+      d_sco += pmt::to_double(msg);
+
+      // More than half a sample per symbol is not a clock offset
+      d_sco = std::max(-0.5, std::min(0.5, d_sco));
+      d_sco_valid = 1;
+
+      PRINTF("OFDM sym acq: timing drift: %.10f, sco: %.10f\n", pmt::to_double(msg), d_sco);
     }
 
+    /*
+     * Switch to the CP length received with TPS, as blind detection does.
+     * Symbol period changes, so the symbol start is acquired again.
+     * Clock and carrier offsets do not depend on it and are kept.
+     * TPS overrides blind detection, also on later restarts.
+     */
+    void
+    ofdm_sym_acquisition_impl::set_guard_interval(int cp_length)
+    {
+      if ((cp_length != d_fft_length / 32) && (cp_length != d_fft_length / 16) && \
+          (cp_length != d_fft_length / 8) && (cp_length != d_fft_length / 4))
+        return;
+
+      d_detect = 0;
+      d_detect_guard = 0;
+
+      if (cp_length == d_cp_length)
+        return;
+
+      printf("OFDM sym acq: cp_length from TPS: %i (was %i)\n", cp_length, d_cp_length);
+
+      d_cp_length = cp_length;
+      d_initial_aquisition = 0;
+      d_freq_correction_count = 0;
+      d_timing_slip_count = 0;
+      d_mu = 0.0;
+    }
+
+    /*
+     * Fractional delay of fft_length samples: out[j] = in(j + mu).
+     * This is a cubic Lagrange interpolator in Farrow form, its taps
+     * are polynomials in mu. Since mu is the same over a symbol
+     * the taps are computed once.
+     * Reads in[-2] to in[fft_length + 1].
+     */
+    void
+    ofdm_sym_acquisition_impl::fractional_delay(const gr_complex * in, gr_complex * out, float mu)
+    {
+      // Interpolate between in[j] and in[j + 1]
+      if (mu < 0)
+      {
+        in--;
+        mu += 1.0;
+      }
+
+      // Taps for in[j - 1], in[j], in[j + 1], in[j + 2]
+      const float h0 = mu * (-1.0 / 3.0 + mu * (0.5 - mu / 6.0));
+      const float h1 = 1.0 + mu * (-0.5 + mu * (-1.0 + mu / 2.0));
+      const float h2 = mu * (1.0 + mu * (0.5 - mu / 2.0));
+      const float h3 = mu * (-1.0 / 6.0 + mu * mu / 6.0);
+
+      for (int j = 0; j < d_fft_length; j++)
+        out[j] = h0 * in[j - 1] + h1 * in[j] + h2 * in[j + 1] + h3 * in[j + 2];
+    }
+
+    /*
+     * Output the symbol of fft_length samples starting on in.
+     * With sampling clock offset correction it is delayed by
+     * the fractional timing first.
+     */
+    void
+    ofdm_sym_acquisition_impl::output_symbol(const gr_complex * in, gr_complex * out)
+    {
+      if (d_sco_valid && (d_mu != 0.0))
+      {
+        fractional_delay(in, d_interp, d_mu);
+        derotate(d_interp, out);
+      }
+      else
+        derotate(in, out);
+    }
+
+    /*
+     * Keep the symbol end inside the input window so that the tracking
+     * search and the fractional delay never read outside it.
+     * When closer than margin to the window edges the symbol end is
+     * moved on the middle by consuming more or less input.
+     * Returns 1 if it was moved.
+     */
     int
-    ofdm_sym_acquisition_impl::ml_sync(const gr_complex * in, int lookup_start, int lookup_stop, int * cp_pos, gr_complex * derot, int * to_consume, int * to_out)
+    ofdm_sym_acquisition_impl::recenter_window(int margin)
+    {
+      const int low = d_fft_length + d_cp_length + d_track_search + 1;
+      const int high = 2 * d_fft_length + d_cp_length - 2;
+
+      if ((d_cp_start >= (low + margin)) && (d_cp_start <= (high - margin)))
+        return (0);
+
+      int delta = d_cp_start - (low + high) / 2;
+
+      d_to_consume += delta;
+      d_cp_start -= delta;
+      advance_phase(delta, 0);
+
+      if (d_nextpos >= 0)
+        d_nextpos = std::max(0, d_nextpos - delta);
+
+      PRINTF("OFDM sym acq: recenter, delta: %i\n", delta);
+
+      return (1);
+    }
+
+    /*
+     * Coarse search of the symbol end between lookup_stop and lookup_start.
+     * The ML metric is evaluated each decimation samples and only on
+     * each decimation-th sample of CP and its copy.
+     * Returns the position with the best metric.
+     */
+    int
+    ofdm_sym_acquisition_impl::coarse_sync(const gr_complex * in, int lookup_start, int lookup_stop, int decimation)
+    {
+      // First CP sample of first position
+      const int base = lookup_stop - (d_cp_length + d_fft_length - 1);
+      const int npos = (lookup_start - lookup_stop) / decimation + 1;
+      const int len = d_cp_length / decimation;
+      const int size = npos + len - 1;
+
+      // Decimated correlation products and energy
+      for (int q = 0; q < size; q++)
+      {
+        const gr_complex x = in[base + q * decimation];
+        const gr_complex y = in[base + q * decimation + d_fft_length];
+
+        d_corr[q] = y * std::conj(x);
+        d_norm[q] = std::norm(x) + std::norm(y);
+      }
+
+      moving_sum(&d_corr[0], len, npos, &d_gamma[0]);
+      moving_sum(&d_norm[0], len, npos, &d_phi[0]);
+
+      unsigned int best = 0;
+
+#ifdef USE_VOLK
+      volk_32fc_magnitude_32f(&d_lambda[0], &d_gamma[0], npos);
+      volk_32f_s32f_multiply_32f(&d_phi[0], &d_phi[0], d_rho / 2.0, npos);
+      volk_32f_x2_subtract_32f(&d_lambda[0], &d_lambda[0], &d_phi[0], npos);
+      volk_32f_index_max_16u(&best, &d_lambda[0], npos);
+#else
+      for (int m = 0; m < npos; m++)
+      {
+        d_lambda[m] = std::abs(d_gamma[m]) - d_phi[m] * d_rho / 2.0;
+
+        if (d_lambda[m] > d_lambda[best])
+          best = m;
+      }
+#endif
+
+      return (lookup_stop + best * decimation);
+    }
+
+    int
+    ofdm_sym_acquisition_impl::ml_sync(const gr_complex * in, int lookup_start, int lookup_stop, int * cp_pos, gr_complex * out, int * to_consume, int * to_out)
     {
 
       assert(lookup_start >= lookup_stop);
@@ -154,10 +625,6 @@ namespace gr {
 
       int low, size;
 
-      // Array to store peak positions
-      int peak_pos[d_fft_length];
-      float d_phi[d_fft_length];
-
       // Calculate norm
 #ifdef USE_VOLK
       low = lookup_stop - (d_cp_length + d_fft_length - 1);
@@ -192,23 +659,22 @@ namespace gr {
 #endif
 
       // Calculate time delay and frequency correction
-      // This looks like spagetti code but it is fast
-      for (int i = lookup_start - 1; i >= lookup_stop; i--)
-      {
-        int k = i - lookup_stop;
+      // gamma and phi are moving sums over CP length, so each
+      // position costs one sample in and one sample out
+      low = lookup_stop - d_cp_length + 1;
+      size = lookup_start - lookup_stop;
 
-        d_phi[k] = 0.0;
-        d_gamma[k] = 0.0;
+      moving_sum(&d_corr[low - d_fft_length], d_cp_length, size, &d_gamma[0]);
 
-        // Moving sum for calculating gamma and phi
-        for (int j = 0; j < d_cp_length; j++)
-        {
-          // Calculate gamma and store it
-          d_gamma[k] += d_corr[i - j - d_fft_length];
-          // Calculate phi and store it
-          d_phi[k] += d_norm[i - j] + d_norm[i - j - d_fft_length];
-        }
-      }
+      // Energy of both CP and its copy, on lambda until lambda is calculated
+#ifdef USE_VOLK
+      volk_32f_x2_add_32f_u(&d_lambda[0], &d_norm[low], &d_norm[low - d_fft_length], size + d_cp_length - 1);
+#else
+      for (int i = 0; i < (size + d_cp_length - 1); i++)
+        d_lambda[i] = d_norm[low + i] + d_norm[low + i - d_fft_length];
+#endif
+
+      moving_sum(&d_lambda[0], d_cp_length, size, &d_phi[0]);
 
       // Init lambda with gamma
 #ifdef USE_VOLK
@@ -261,54 +727,36 @@ namespace gr {
         printf("lambda[%i]: %.10f\n", i, d_lambda[i]);
 #endif
 
-      int peak_length, peak, peak_max;
-      // Find peaks of lambda
-      // We have found an end of symbol at peak_pos[0] + CP + FFT
-      if (peak_length = peak_detect_process(&d_lambda[0], (lookup_start - lookup_stop), &peak_pos[0], &peak_max))
+      int peak_found, peak_pos, peak;
+      // Find peak of lambda
+      // We have found an end of symbol at peak_pos + CP + FFT
+      if (peak_found = peak_detect_process(&d_lambda[0], (lookup_start - lookup_stop), &peak_pos))
       {
-        peak = peak_pos[peak_max] + lookup_stop;
+        peak = peak_pos + lookup_stop;
 #if 0
-        printf("peak: %i, peak_pos: %i, lambda[%i]: %f\n", peak, peak_pos[peak_max], peak_pos[peak_max], d_lambda[peak_pos[peak_max]]);
+        printf("peak: %i, peak_pos: %i, lambda[%i]: %f\n", peak, peak_pos, peak_pos, d_lambda[peak_pos]);
 #endif
         *cp_pos = peak;
 
         // Calculate frequency correction
         /*float peak_epsilon = gr_fast_atan2f(d_gamma[peak_pos[0]]);*/
-        float peak_epsilon = fast_atan2f(d_gamma[peak_pos[peak_max]]);
+        float peak_epsilon = fast_atan2f(d_gamma[peak_pos]);
         double sensitivity = (double)(-1) / (double)d_fft_length;
 
         //printf("peak_epsilon: %.10f\n", peak_epsilon);
         //printf("d_phaseinc before fft: %.10f\n", d_phaseinc);
 
-        // Store phases for derotating the signal
-        // We always process CP len + FFT len
-        for (int i = 0; i < (d_cp_length + d_fft_length); i++)
-        {
-          if (i == d_nextpos)
-            d_phaseinc = d_nextphaseinc;
-
-          // We are interested only in fft_length
-          d_phase += d_phaseinc;
-
-          while (d_phase > (float)M_PI)
-            d_phase -= (float)(2.0 * M_PI);
-          while (d_phase < (float)(-M_PI))
-            d_phase += (float)(2.0 * M_PI);
+        // Derotate the symbol (fft_length samples ending on the peak)
+        // and advance the phase over the whole symbol (CP len + FFT len)
+        // With sampling clock offset correction the symbol end is
+        // predicted and the peak only confirms the symbol
+        if (out)
+          output_symbol(&in[(d_sco_valid ? d_timing_pos : peak) - d_fft_length + 1], out);
 
-          //printf("d_phase[%i]: %.10f, d_phaseinc: %.10f\n", d_index++, d_phase, d_phaseinc);
+        advance_phase(d_cp_length + d_fft_length, 1);
 
-#ifdef USE_FIXEDARCTAN
-          float oq, oi;
-          gr_int32 angle = gr_fxpt::float_to_fixed (d_phase);
-          gr_fxpt::sincos(angle, &oq, &oi);
-
-          derot[i] = gr_complex(oi, oq);
-#else
-          derot[i] = gr_expj(d_phase);
-#endif
-        }
-            
-        d_nextphaseinc = sensitivity * peak_epsilon;
+        // Carrier offset from demodulator corrects the CP estimation
+        d_nextphaseinc = sensitivity * (peak_epsilon + 2 * M_PI * d_cfo);
         d_nextpos = peak - (d_cp_length + d_fft_length);
               
         //printf("d_phaseinc after fft: %.10f\n", d_phaseinc);
@@ -332,28 +780,30 @@ namespace gr {
         for (int i = 0; i < d_fft_length; i++)
           printf("lambda[%i]: %.10f\n", i, d_lambda[i]);
 #endif
-        for (int i = 0; i < (d_cp_length + d_fft_length); i++)
-        {
-          d_phase += d_phaseinc;
+        // Coast over a few missed symbols on the predicted position
+        // so that a short fade does not restart acquisition
+        *to_out = 0;
 
-          while (d_phase > (float)M_PI)
-            d_phase -= (float)(2.0 * M_PI);
-          while (d_phase < (float)(-M_PI))
-            d_phase += (float)(2.0 * M_PI);
+        if (out && (d_freq_correction_count < d_freq_correction_timeout))
+        {
+          output_symbol(&in[d_timing_pos - d_fft_length + 1], out);
+          *to_out = 1;
         }
 
-        // We consume only fft_length
+        // No new frequency estimation
+        advance_phase(d_cp_length + d_fft_length, 1);
+        d_nextpos = -1;
+
         *to_consume = d_cp_length + d_fft_length;
-        *to_out = 0;
       }
 
-      return (peak_length);
+      return (peak_found);
     }
 
     void
-    ofdm_sym_acquisition_impl::send_sync_start()
+    ofdm_sym_acquisition_impl::send_sync_start(int produced)
     {
-      const uint64_t offset = this->nitems_written(0);
+      const uint64_t offset = this->nitems_written(0) + produced;
       pmt::pmt_t key = pmt::string_to_symbol("sync_start");
       pmt::pmt_t value = pmt::from_long(1);
       this->add_item_tag(0, offset, key, value);
@@ -367,23 +817,43 @@ namespace gr {
 
 
     ofdm_sym_acquisition::sptr
-    ofdm_sym_acquisition::make(int blocks, int fft_length, int occupied_tones, int cp_length, float snr)
+    ofdm_sym_acquisition::make(int blocks, int fft_length, int occupied_tones, int cp_length, float snr, int do_fft)
     {
-      return gnuradio::get_initial_sptr (new ofdm_sym_acquisition_impl(blocks, fft_length, occupied_tones, cp_length, snr));
+      return gnuradio::get_initial_sptr (new ofdm_sym_acquisition_impl(blocks, fft_length, occupied_tones, cp_length, snr, do_fft));
     }
 
     /*
      * The private constructor
      */
-    ofdm_sym_acquisition_impl::ofdm_sym_acquisition_impl(int blocks, int fft_length, int occupied_tones, int cp_length, float snr)
+    ofdm_sym_acquisition_impl::ofdm_sym_acquisition_impl(int blocks, int fft_length, int occupied_tones, int cp_length, float snr, int do_fft)
       : block("ofdm_sym_acquisition",
           io_signature::make(1, 1, sizeof (gr_complex) * blocks),
           io_signature::make(1, 1, sizeof (gr_complex) * blocks * fft_length)),
       d_blocks(blocks), d_fft_length(fft_length), d_cp_length(cp_length), d_snr(snr),
       d_index(0), d_phase(0.0), d_phaseinc(0.0), d_cp_found(0), d_count(0), d_nextphaseinc(0), d_nextpos(0), \
         d_sym_acq_count(0),d_sym_acq_timeout(100), d_initial_aquisition(0), \
-        d_freq_correction_count(0), d_freq_correction_timeout(0)
+        d_freq_correction_count(0), d_freq_correction_timeout(8), d_detect(0), \
+        d_sco_valid(0), d_sco(0.0), d_mu(0.0), d_cfo(0.0), d_timing_pos(0), d_timing_slip_count(0), \
+        d_timing_port(pmt::mp("timing_drift")), \
+        d_fft_plan(NULL), d_fft_buf(NULL), d_fft_shift(0.0)
     {
+      // CP length 0 means detect guard interval
+      if (d_cp_length == 0)
+      {
+        if (d_fft_length > 8192)
+          std::cout << "Error: cannot detect guard interval for fft_length: " << d_fft_length << std::endl;
+        else
+          d_detect = 1;
+
+        // Until detected
+        d_cp_length = d_fft_length / 32;
+      }
+
+      // Detect again on each acquisition restart
+      d_detect_guard = d_detect;
+
+      // Not changed after detection or TPS, shortest guard interval
+      // is the largest rate
       set_relative_rate(1.0 / (double) (d_cp_length + d_fft_length));
 
       d_snr = pow(10, d_snr / 10.0);
@@ -392,58 +862,71 @@ namespace gr {
       printf("OFDM sym acq: blocks: %i\n", blocks);
       printf("OFDM sym acq: fft_length: %i\n", fft_length);
       printf("OFDM sym acq: occupied_tones: %i\n", occupied_tones);
+      printf("OFDM sym acq: cp_length: %i, detect: %i\n", d_cp_length, d_detect);
       printf("OFDM sym acq: SNR: %f\n", d_snr);
+      printf("OFDM sym acq: do_fft: %i\n", do_fft);
+
+      if (do_fft)
+      {
+        // Planned once, in place. Input is derotated straight into
+        // the output buffer and the plan is run on it.
+        d_fft_buf = (gr_complex *)fftwf_malloc(sizeof(gr_complex) * d_fft_length);
+        if (d_fft_buf == NULL)
+          std::cout << "cannot allocate memory: d_fft_buf" << std::endl;
+
+        gr::fft::planner::scoped_lock lock(gr::fft::planner::mutex());
+        d_fft_plan = fftwf_plan_dft_1d(d_fft_length, (fftwf_complex *)d_fft_buf, \
+            (fftwf_complex *)d_fft_buf, FFTW_FORWARD, FFTW_MEASURE);
+
+        // Multiplying the input with (-1)^n does the FFT shift
+        d_fft_shift = M_PI;
+      }
 
       const int alignment_multiple = volk_get_alignment() / sizeof(gr_complex);
       set_alignment(std::max(1, alignment_multiple));
 
       const int alignment = volk_get_alignment();
 
-#ifdef USE_POSIX_MEMALIGN
-      if (posix_memalign((void **)&d_gamma, alignment, sizeof(gr_complex) * d_fft_length))
-        std::cout << "cannot allocate memory: d_gamma" << std::endl;
-
-      if (posix_memalign((void **)&d_lambda, alignment, sizeof(float) * d_fft_length))
-        std::cout << "cannot allocate memory: d_lambda" << std::endl;
+      // When the guard interval is detected buffers are large enough
+      // for the detection window, otherwise for the longest guard
+      // interval (TPS may switch to it)
+      // While tracking the search window may end d_track_search samples
+      // after the next symbol
+      int length = (d_detect ? d_detect_length : (2 * d_fft_length + std::max(d_cp_length, d_fft_length / 4))) \
+        + d_track_search + 1;
+
+      // All work buffers are carved from one arena, each of them
+      // starting aligned. It is cleared once here so that its pages
+      // are mapped before the first work call.
+      const int csize = align_size(sizeof(gr_complex) * length, alignment);
+      const int fsize = align_size(sizeof(float) * length, alignment);
+      const int isize = align_size(sizeof(gr_complex) * d_fft_length, alignment);
+      const int arena_size = 2 * csize + 5 * fsize + isize;
 
-      if (posix_memalign((void **)&d_derot, alignment, sizeof(gr_complex) * (d_fft_length + d_cp_length)))
-        std::cout << "cannot allocate memory: d_derot" << std::endl;
-
-      if (posix_memalign((void **)&d_conj, alignment, sizeof(gr_complex) * (2 * d_fft_length + d_cp_length)))
-        std::cout << "cannot allocate memory: d_conj" << std::endl;
-
-      if (posix_memalign((void **)&d_norm, alignment, sizeof(float) * (2 * d_fft_length + d_cp_length)))
-        std::cout << "cannot allocate memoryi: d_norm" << std::endl;
-
-      if (posix_memalign((void **)&d_corr, alignment, sizeof(gr_complex) * (2 * d_fft_length + d_cp_length)))
-        std::cout << "cannot allocate memoryi: d_corr" << std::endl;
+#ifdef USE_POSIX_MEMALIGN
+      if (posix_memalign((void **)&d_arena, alignment, arena_size))
+        std::cout << "cannot allocate memory: d_arena" << std::endl;
 #else
-      d_gamma = new gr_complex[d_fft_length];
-      if (d_gamma == NULL)
-        std::cout << "cannot allocate memory: d_gamma" << std::endl;
-
-      d_lambda = new float[d_fft_length];
-      if (d_lambda == NULL)
-        std::cout << "cannot allocate memory: d_lambda" << std::endl;
-
-      d_derot = new gr_complex[d_cp_length + d_fft_length];
-      if (d_derot == NULL)
-        std::cout << "cannot allocate memory: d_derot" << std::endl;
-
-      d_conj = new gr_complex[2 * d_fft_length + d_cp_length];
-      if (d_conj == NULL)
-        std::cout << "cannot allocate memory: d_conj" << std::endl;
-
-      d_norm = new float[2 * d_fft_length + d_cp_length];
-      if (d_norm == NULL)
-        std::cout << "cannot allocate memory: d_norm" << std::endl;
-
-      d_corr = new gr_complex[2 * d_fft_length + d_cp_length];
-      if (d_corr == NULL)
-        std::cout << "cannot allocate memory: d_corr" << std::endl;
+      d_arena = new char[arena_size];
+      if (d_arena == NULL)
+        std::cout << "cannot allocate memory: d_arena" << std::endl;
 #endif
+      memset(d_arena, 0, arena_size);
+
+      char * p = d_arena;
+      d_gamma = (gr_complex *)p; p += csize;
+      d_corr = (gr_complex *)p; p += csize;
+      d_phi = (float *)p; p += fsize;
+      d_lambda = (float *)p; p += fsize;
+      d_norm = (float *)p; p += fsize;
+      d_peak_rise = (float *)p; p += fsize;
+      d_peak_fall = (float *)p; p += fsize;
+      d_interp = (gr_complex *)p;
+
+      // Sampling clock, carrier offsets and guard interval from demodulator
+      message_port_register_in(d_timing_port);
+      set_msg_handler(d_timing_port, boost::bind(&ofdm_sym_acquisition_impl::timing_drift_msg, this, _1));
 
-      //peak_detect_init(0.2, 0.25, 30, 0.0005);
       peak_detect_init(0.8, 0.9, 30, 0.9);
     }
 
@@ -452,20 +935,17 @@ namespace gr {
      */
     ofdm_sym_acquisition_impl::~ofdm_sym_acquisition_impl()
     {
+      if (d_fft_buf)
+      {
+        gr::fft::planner::scoped_lock lock(gr::fft::planner::mutex());
+        fftwf_destroy_plan(d_fft_plan);
+        fftwf_free(d_fft_buf);
+      }
+
 #ifdef USE_POSIX_MEMALIGN
-      free(d_gamma);
-      free(d_lambda);
-      free(d_derot);
-      free(d_conj);
-      free(d_norm);
-      free(d_corr);
+      free(d_arena);
 #else
-      delete [] d_gamma;
-      delete [] d_lambda;
-      delete [] d_derot;
-      delete [] d_conj;
-      delete [] d_norm;
-      delete [] d_corr;
+      delete [] d_arena;
 #endif
     }
 
@@ -474,9 +954,16 @@ namespace gr {
     {
       int ninputs = ninput_items_required.size ();
 
-      // make sure we receive at least (symbol_length + fft_length)
+      // make sure we receive noutput_items symbols plus the next
+      // fft_length and the tracking search window, or the whole detection window
       for (int i = 0; i < ninputs; i++)
-        ninput_items_required[i] = (2 * d_fft_length + d_cp_length) * noutput_items;
+      {
+        ninput_items_required[i] = (d_fft_length + d_cp_length) * (noutput_items - 1) \
+          + 2 * d_fft_length + d_cp_length + d_track_search;
+
+        if (d_detect)
+          ninput_items_required[i] = std::max(ninput_items_required[i], d_detect_length);
+      }
     }
 
     /*
@@ -493,77 +980,171 @@ namespace gr {
         const gr_complex *in = (const gr_complex *) input_items[0];
         gr_complex *out = (gr_complex *) output_items[0];
 
-        int low, size;
+        // Process as many symbols as the input holds.
+        // Each symbol needs a symbol plus an FFT length and
+        // the tracking search window after it.
+        int consumed = 0;
+        int produced = 0;
 
-        // This is initial aquisition of symbol start
-        // TODO - make a FSM
-        if (!d_initial_aquisition)
+        while (produced < noutput_items)
         {
-          d_initial_aquisition = ml_sync(in, 2 * d_fft_length + d_cp_length - 1, d_fft_length + d_cp_length - 1, \
-              &d_cp_start, &d_derot[0], &d_to_consume, &d_to_out);
+          int available = ninput_items[0] - consumed;
 
-          // Send sync_start downstream
-          send_sync_start();
+          if (available < (d_detect ? d_detect_length : (2 * d_fft_length + d_cp_length + d_track_search)))
+            break;
 
-          PRINTF("initial_acq: %i, d_cp_start: %i, d_to_consume,: %i, d_to_out: %i\n", d_initial_aquisition, d_cp_start, d_to_consume, d_to_out);
-        }
+          const gr_complex * ins = &in[consumed];
+          gr_complex * outs = &out[produced * d_blocks * d_fft_length];
 
-        // This is fractional frequency correction (pre FFT)
-        // It is also calle coarse frequency correction
-        if (d_initial_aquisition)
-        {
-          d_cp_found = ml_sync(in, d_cp_start + 8, d_cp_start - 8, \
-              &d_cp_start, &d_derot[0], &d_to_consume, &d_to_out);
-          
-          PRINTF("short_acq: %i, d_cp_start: %i, d_to_consume: %i, d_to_out: %i\n", d_cp_found, d_cp_start, d_to_consume, d_to_out);
+          d_to_out = 0;
 
-          if (d_cp_found)
+          // Detect guard interval (and check transmission mode) first
+          if (d_detect)
           {
-            d_freq_correction_count = 0;
+            int fft_length, cp_length;
 
-            // Derotate the signal and out
-#ifdef USE_VOLK
-            low = d_cp_start - d_fft_length + 1;
-            size = d_cp_start - (d_cp_start - d_fft_length + 1) + 1;
+            if (detect_mode_guard(ins, &fft_length, &cp_length))
+            {
+              d_cp_length = cp_length;
+              d_detect = 0;
 
-            if(is_unaligned())
-              volk_32fc_x2_multiply_32fc_u(&out[0], &d_derot[0], &in[low], size);
+              printf("OFDM sym acq: detected fft_length: %i, cp_length: %i\n", fft_length, cp_length);
+            }
             else
-              //volk_32fc_x2_multiply_32fc_a(&out[0], &d_derot[0], &in[low], size);
-              volk_32fc_x2_multiply_32fc_u(&out[0], &d_derot[0], &in[low], size);
-              // TODO - fix the alignment
-#else
-            int j = 0;
-            for (int i = (d_cp_start - d_fft_length + 1); i <= d_cp_start; i++)
             {
-              out[j] = d_derot[j] * in[i];
-              j++;
+              consumed += d_fft_length;
+              continue;
             }
-#endif
           }
-          else
+
+          // This is initial aquisition of symbol start
+          // TODO - make a FSM
+          if (!d_initial_aquisition)
           {
-            // If we have a number of consecutive misses then we restart aquisition
-            if (++d_freq_correction_count > d_freq_correction_timeout)
+            // Coarse stage on decimated input over the whole symbol
+            // Short guard intervals get a smaller decimation
+            int decimation = std::max(1, std::min(d_coarse_decimation, d_cp_length / 16));
+            int coarse = coarse_sync(ins, 2 * d_fft_length + d_cp_length - 1, \
+                d_fft_length + d_cp_length - 1, decimation);
+
+            // Fine stage on full resolution around coarse peak
+            int search = std::max(d_cp_length / 8, decimation);
+            int lookup_start = std::min(coarse + search, 2 * d_fft_length + d_cp_length - 1);
+            int lookup_stop = std::max(coarse - search, d_fft_length + d_cp_length - 1);
+
+            d_initial_aquisition = ml_sync(ins, lookup_start, lookup_stop, \
+                &d_cp_start, NULL, &d_to_consume, &d_to_out);
+
+            // Send sync_start downstream
+            send_sync_start(produced);
+
+            PRINTF("initial_acq: %i, d_cp_start: %i, d_to_consume,: %i, d_to_out: %i\n", d_initial_aquisition, d_cp_start, d_to_consume, d_to_out);
+
+            // A symbol found too close to the window edges cannot be
+            // tracked, move it on the middle first (this one is lost)
+            if (d_initial_aquisition && recenter_window(0))
             {
-              d_initial_aquisition = 0;
-              d_freq_correction_count = 0;
+              d_mu = 0.0;
+              consumed += d_to_consume;
+              continue;
+            }
+          }
+
+          // This is fractional frequency correction (pre FFT)
+          // It is also calle coarse frequency correction
+          if (d_initial_aquisition)
+          {
+            // Predict the symbol end with the sampling clock offset
+            // Integer part of the timing moves the symbol end
+            int step = 0;
+
+            if (d_sco_valid)
+            {
+              d_mu += d_sco;
+              step = (int)floor(d_mu + 0.5);
+              d_mu -= step;
+            }
+
+            d_timing_pos = d_cp_start + step;
+
+            // Output is derotated when CP is found
+            d_cp_found = ml_sync(ins, d_timing_pos + d_track_search, d_timing_pos - d_track_search, \
+                &d_cp_start, outs, &d_to_consume, &d_to_out);
+
+            // The CP peak keeps the predicted timing on the symbol:
+            // its offset (at most 1 sample) pulls the fractional timing,
+            // a peak away for several symbols is a timing jump
+            // (missed samples, channel change) and the timing moves on it
+            if (d_sco_valid)
+            {
+              int err = d_cp_found ? (d_cp_start - d_timing_pos) : 0;
+
+              if (std::abs(err) > 1)
+              {
+                if (++d_timing_slip_count >= d_timing_slip_symbols)
+                {
+                  PRINTF("OFDM sym acq: timing re-anchored, err: %i\n", err);
+
+                  d_timing_pos = d_cp_start;
+                  d_mu = 0.0;
+                  d_timing_slip_count = 0;
+                  err = 0;
+                }
+              }
+              else
+                d_timing_slip_count = 0;
+
+              d_mu += d_timing_gain * std::max(-1, std::min(1, err));
+              d_cp_start = d_timing_pos;
+            }
 
-              printf("restart aquisition\n");
+            PRINTF("short_acq: %i, d_cp_start: %i, d_to_consume: %i, d_to_out: %i\n", d_cp_found, d_cp_start, d_to_consume, d_to_out);
 
-              // Restart wit a half number so that we'll not endup with the same situation
-              // This will prevent peak_detect to not detect anything
-              d_to_consume = d_to_consume / 2;
+            if (d_cp_found)
+            {
+              d_freq_correction_count = 0;
             }
+            else
+            {
+              // If we have a number of consecutive misses then we restart aquisition
+              if (++d_freq_correction_count > d_freq_correction_timeout)
+              {
+                d_initial_aquisition = 0;
+                d_freq_correction_count = 0;
+
+                // Guard interval may have changed
+                d_detect = d_detect_guard;
+
+                // Sampling clock and carrier offsets are estimated again
+                d_sco_valid = 0;
+                d_sco = 0.0;
+                d_mu = 0.0;
+                d_cfo = 0.0;
+                d_timing_slip_count = 0;
+
+                printf("restart aquisition\n");
+
+                // Restart wit a half number so that we'll not endup with the same situation
+                // This will prevent peak_detect to not detect anything
+                d_to_consume = d_to_consume / 2;
+              }
+            }
+
+            // Drift (or peak jumps) must not take the symbol out of the window
+            if (d_initial_aquisition)
+              recenter_window(d_track_search);
           }
+
+          consumed += d_to_consume;
+          produced += d_to_out;
         }
 
         // Tell runtime system how many input items we consumed on
         // each input stream.
-        consume_each(d_to_consume);
+        consume_each(consumed);
 
         // Tell runtime system how many output items we produced.
-        return (d_to_out);
+        return (produced);
     }
   } /* namespace dvbt */
 } /* namespace gr */
@@ -22,6 +22,8 @@
 #define INCLUDED_DVBT_OFDM_SYM_ACQUISITION_IMPL_H
 
 #include <dvbt/ofdm_sym_acquisition.h>
+#include <gnuradio/fft/fft.h>
+#include <fftw3.h>
 
 namespace gr {
   namespace dvbt {
@@ -38,21 +40,23 @@ namespace gr {
       int d_index;
       int d_count;
 
-      int d_search_max;
-
-      gr_complex * d_conj;
+      // Work buffers, all in one aligned arena
+      char * d_arena;
       float * d_norm;
       gr_complex * d_corr;
       gr_complex * d_gamma;
+      float * d_phi;
       float * d_lambda;
-      float * d_arg;
 
       // For peak detector
       float d_threshold_factor_rise;
       float d_threshold_factor_fall;
       float d_avg_alpha;
       float d_avg;
-      float d_phase;
+      // Rise and fall thresholds of each sample
+      float * d_peak_rise;
+      float * d_peak_fall;
+      double d_phase;
       double d_phaseinc;
       double d_nextphaseinc;
       int d_nextpos;
@@ -65,22 +69,79 @@ namespace gr {
       int d_freq_correction_timeout;
       int d_freq_correction_count;
 
+      // Blind detection of transmission mode and guard interval
+      int d_detect;
+      // Detection was requested (cp_length 0), it is done again
+      // when acquisition restarts (until guard interval comes from TPS)
+      int d_detect_guard;
+      // Input window used for detection
+      static const int d_detect_length;
+      // Min correlation coefficient to accept a detection
+      static const float d_detect_min_coef;
+
+      // Search window (+/-) around CP position while tracking
+      static const int d_track_search;
+
+      // Initial acquisition is done first on decimated input, then
+      // on full resolution only around the coarse peak
+      static const int d_coarse_decimation;
+
+      // Sampling clock offset correction
+      // Drift of symbol start (samples per symbol) received from
+      // demodulator, integer part moves the symbol start and
+      // fractional part (d_mu) is done with a fractional delay filter
+      int d_sco_valid;
+      double d_sco;
+      double d_mu;
+      // Carrier frequency offset (subcarrier spacings) received from
+      // demodulator, added to the CP estimation of each symbol
+      double d_cfo;
+      // Predicted symbol end while tracking
+      int d_timing_pos;
+      // CP peak offset correction of predicted timing
+      static const float d_timing_gain;
+      static const int d_timing_slip_symbols;
+      int d_timing_slip_count;
+      gr_complex * d_interp;
+      const pmt::pmt_t d_timing_port;
+
+      // FFT done here, planned in place and run on the output buffer
+      // (on d_fft_buf when the output is not aligned as the plan)
+      fftwf_plan d_fft_plan;
+      gr_complex * d_fft_buf;
+      // Phase increment that moves DC on the middle of the FFT
+      double d_fft_shift;
+
       int d_cp_found;
       int d_cp_start;
-      gr_complex * d_derot;
       int d_to_consume;
       int d_to_out;
 
-      int ml_sync(const gr_complex * in, int lookup_start, int lookup_stop, int * cp_pos, gr_complex * derot, int * to_consume, int * to_out);
+      void moving_sum(const gr_complex * x, int len, int size, gr_complex * y);
+      void moving_sum(const float * x, int len, int size, float * y);
+      int detect_mode_guard(const gr_complex * in, int * fft_length, int * cp_length);
+
+      void advance_phase(int n, int use_nextpos);
+      void rotate(const gr_complex * in, gr_complex * out, double phase, double phaseinc, int n);
+      void derotate(const gr_complex * in, gr_complex * out);
+
+      void timing_drift_msg(pmt::pmt_t msg);
+      void set_guard_interval(int cp_length);
+      void fractional_delay(const gr_complex * in, gr_complex * out, float mu);
+      void output_symbol(const gr_complex * in, gr_complex * out);
+      int recenter_window(int margin);
+
+      int coarse_sync(const gr_complex * in, int lookup_start, int lookup_stop, int decimation);
+      int ml_sync(const gr_complex * in, int lookup_start, int lookup_stop, int * cp_pos, gr_complex * out, int * to_consume, int * to_out);
       int cp_sync(const gr_complex * in, int * cp_pos, gr_complex * derot, int * to_consume, int * to_out);
       
       int peak_detect_init(float threshold_factor_rise, float threshold_factor_fall, int look_ahead, float alpha);
       
-      int peak_detect_process(const float * datain, const int datain_length, int * peak_pos, int * peak_max);
+      int peak_detect_process(const float * datain, const int datain_length, int * peak_pos);
 
-      void send_sync_start();
+      void send_sync_start(int produced);
     public:
-      ofdm_sym_acquisition_impl(int blocks, int fft_length, int occupied_tones, int cp_length, float snr);
+      ofdm_sym_acquisition_impl(int blocks, int fft_length, int occupied_tones, int cp_length, float snr, int do_fft);
       ~ofdm_sym_acquisition_impl();
 
       void forecast (int noutput_items, gr_vector_int &ninput_items_required);
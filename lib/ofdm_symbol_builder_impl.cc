@@ -0,0 +1,153 @@
+/* -*- c++ -*- */
+/* 
+ * Copyright 2013 <Bogdan Diaconescu, yo3iiu@yo3iiu.ro>.
+ * 
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ * 
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gnuradio/io_signature.h>
+#include "ofdm_symbol_builder_impl.h"
+#include "dvbt_map_impl.h"
+#include "symbol_inner_interleaver_impl.h"
+#include <stdio.h>
+
+namespace gr {
+  namespace dvbt {
+
+    ofdm_symbol_builder::sptr
+    ofdm_symbol_builder::make(dvbt_constellation_t constellation, dvbt_hierarchy_t hierarchy, \
+        dvbt_code_rate_t code_rate_HP, dvbt_code_rate_t code_rate_LP, \
+        dvbt_guard_interval_t guard_interval, dvbt_transmission_mode_t transmission_mode, \
+        int include_cell_id, int cell_id, float gain)
+    {
+      return gnuradio::get_initial_sptr (new ofdm_symbol_builder_impl(constellation, hierarchy, \
+            code_rate_HP, code_rate_LP, guard_interval, transmission_mode, include_cell_id, cell_id, gain));
+    }
+
+    /*
+     * The private constructor
+     */
+    ofdm_symbol_builder_impl::ofdm_symbol_builder_impl(dvbt_constellation_t constellation, dvbt_hierarchy_t hierarchy, \
+        dvbt_code_rate_t code_rate_HP, dvbt_code_rate_t code_rate_LP, \
+        dvbt_guard_interval_t guard_interval, dvbt_transmission_mode_t transmission_mode, \
+        int include_cell_id, int cell_id, float gain)
+      : block("ofdm_symbol_builder",
+          io_signature::make(1, 1, sizeof (unsigned char) * \
+            dvbt_config(constellation, hierarchy, code_rate_HP, code_rate_LP, guard_interval, transmission_mode).d_payload_length),
+          io_signature::make(1, 1, sizeof (gr_complex) * \
+            dvbt_config(constellation, hierarchy, code_rate_HP, code_rate_LP, guard_interval, transmission_mode).d_fft_length)),
+          config(constellation, hierarchy, code_rate_HP, code_rate_LP, \
+              guard_interval, transmission_mode, include_cell_id, cell_id),
+          d_pg(config)
+    {
+      d_payload_length = config.d_payload_length;
+      d_fft_length = config.d_fft_length;
+
+      printf("OFDM symbol builder, d_payload_length: %i\n", d_payload_length);
+      printf("OFDM symbol builder, d_fft_length: %i\n", d_fft_length);
+
+      d_constellation_points = new gr_complex[config.d_constellation_size];
+      if (d_constellation_points == NULL)
+      {
+        std::cout << "cannot allocate d_constellation_points" << std::endl;
+        return;
+      }
+
+      dvbt_map_impl::make_constellation_points(d_constellation_points, config.d_constellation_size, \
+          config.d_step, config.d_alpha, gain * config.d_norm);
+
+      d_carrier_map[0] = new int[4 * d_payload_length];
+      if (d_carrier_map[0] == NULL)
+      {
+        std::cout << "cannot allocate d_carrier_map" << std::endl;
+        return;
+      }
+
+      // ETSI EN 300 744 Clause 4.3.4.2
+      // Even symbols: y(H(q)) = x(q), odd symbols: y(q) = x(H(q)),
+      // then y(q) goes on q-th payload carrier (as symbol_inner_interleaver).
+      // Scattered pilot phase and symbol parity go together.
+      const int * h = symbol_inner_interleaver_impl::H_table(config.d_transmission_mode);
+
+      for (int phase = 0; phase < 4; phase++)
+      {
+        const int * payload = d_pg.get_payload_carriers(phase);
+
+        d_carrier_map[phase] = d_carrier_map[0] + phase * d_payload_length;
+
+        for (int q = 0; q < d_payload_length; q++)
+        {
+          if (phase % 2)
+            d_carrier_map[phase][h[q]] = config.d_zeros_on_left + payload[q];
+          else
+            d_carrier_map[phase][q] = config.d_zeros_on_left + payload[h[q]];
+        }
+      }
+    }
+
+    /*
+     * Our virtual destructor.
+     */
+    ofdm_symbol_builder_impl::~ofdm_symbol_builder_impl()
+    {
+      delete [] d_carrier_map[0];
+      delete [] d_constellation_points;
+    }
+
+    void
+    ofdm_symbol_builder_impl::build_symbol(const unsigned char * in, gr_complex * out)
+    {
+      // Zeros and pilots first, then map each symbol
+      // straight on its carrier
+      const int * carrier = d_carrier_map[d_pg.start_tx_symbol(out) % 4];
+
+      for (int q = 0; q < d_payload_length; q++)
+        out[carrier[q]] = d_constellation_points[in[q]];
+    }
+
+    void
+    ofdm_symbol_builder_impl::forecast (int noutput_items, gr_vector_int &ninput_items_required)
+    {
+      ninput_items_required[0] = noutput_items;
+    }
+
+    int
+    ofdm_symbol_builder_impl::general_work (int noutput_items,
+                       gr_vector_int &ninput_items,
+                       gr_vector_const_void_star &input_items,
+                       gr_vector_void_star &output_items)
+    {
+        const unsigned char *in = (const unsigned char *) input_items[0];
+        gr_complex *out = (gr_complex *) output_items[0];
+
+        for (int i = 0; i < noutput_items; i++)
+          build_symbol(&in[i * d_payload_length], &out[i * d_fft_length]);
+
+        // Tell runtime system how many input items we consumed on
+        // each input stream.
+        consume_each (noutput_items);
+
+        // Tell runtime system how many output items we produced.
+        return noutput_items;
+    }
+
+  } /* namespace dvbt */
+} /* namespace gr */
+
@@ -0,0 +1,95 @@
+/* -*- c++ -*- */
+/* 
+ * Copyright 2013 <Bogdan Diaconescu, yo3iiu@yo3iiu.ro>.
+ * 
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ * 
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef INCLUDED_DVBT_OFDM_SYMBOL_BUILDER_IMPL_H
+#define INCLUDED_DVBT_OFDM_SYMBOL_BUILDER_IMPL_H
+
+#include <dvbt/ofdm_symbol_builder.h>
+#include <dvbt/dvbt_config.h>
+#include "reference_signals_impl.h"
+
+namespace gr {
+  namespace dvbt {
+    /*!
+     * \brief OFDM symbol builder class.
+     * \ingroup dvbt
+     * \param constellation constellation used \n
+     * \param hierarchy hierarchy used \n
+     * \param code_rate_HP high priority stream code rate \n
+     * \param code_rate_LP low priority stream code rate \n
+     * \param guard_interval guard interval used \n
+     * \param transmission_mode transmission mode used \n
+     * \param include_cell_id include or not cell id \n
+     * \param cell_id cell id \n
+     * \param gain gain of complex output stream \n
+     */
+    class ofdm_symbol_builder_impl : public ofdm_symbol_builder
+    {
+    private:
+      const dvbt_config config;
+
+      // Pilot Generator object, gives zeros and pilots of each symbol
+      pilot_gen d_pg;
+
+      int d_payload_length;
+      int d_fft_length;
+
+      gr_complex * d_constellation_points;
+
+      // Carrier (in output vector) of each input symbol
+      // for each scattered pilot phase (symbol index % 4).
+      // Symbol interleaving and payload carriers in one map.
+      int * d_carrier_map[4];
+
+    public:
+      ofdm_symbol_builder_impl(dvbt_constellation_t constellation, dvbt_hierarchy_t hierarchy, \
+          dvbt_code_rate_t code_rate_HP, dvbt_code_rate_t code_rate_LP, \
+          dvbt_guard_interval_t guard_interval, dvbt_transmission_mode_t transmission_mode, \
+          int include_cell_id, int cell_id, float gain);
+      ~ofdm_symbol_builder_impl();
+
+      // Build one OFDM symbol (fft_length carriers) from payload_length
+      // bit interleaver output symbols
+      void build_symbol(const unsigned char * in, gr_complex * out);
+
+      void forecast (int noutput_items, gr_vector_int &ninput_items_required);
+
+      /*!
+       * ETSI EN 300 744 Clause 4.3.4.2, 4.3.5, 4.5. \n
+       * Data input format (output of bit inner interleaver): \n
+       * 000000Y0Y1 - QAM4 \n
+       * 0000Y0Y1Y2Y3 - QAM16 \n
+       * 00Y0Y1Y2Y3Y4Y5 - QAM64 \n
+       *
+       * Data output format: \n
+       * complex(real(float), imag(float)), fft_length carriers
+       * with DC on the middle (IFFT with shift) \n
+       */
+      int general_work(int noutput_items,
+           gr_vector_int &ninput_items,
+           gr_vector_const_void_star &input_items,
+           gr_vector_void_star &output_items);
+    };
+
+  } // namespace dvbt
+} // namespace gr
+
+#endif /* INCLUDED_DVBT_OFDM_SYMBOL_BUILDER_IMPL_H */
+
@@ -50,6 +50,7 @@
 #include "qa_reed_solomon_dec.h"
 #include "qa_ofdm_sym_acquisition.h"
 #include "qa_viterbi_decoder.h"
+#include "qa_ofdm_symbol_builder.h"
 
 CppUnit::TestSuite *
 qa_dvbt::suite()
@@ -79,6 +80,7 @@ qa_dvbt::suite()
   s->addTest(gr::dvbt::qa_reed_solomon_dec::suite());
   s->addTest(gr::dvbt::qa_ofdm_sym_acquisition::suite());
   s->addTest(gr::dvbt::qa_viterbi_decoder::suite());
+  s->addTest(gr::dvbt::qa_ofdm_symbol_builder::suite());
 
   return s;
 }
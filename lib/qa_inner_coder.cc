@@ -23,14 +23,103 @@
 #include <cppunit/TestAssert.h>
 
 #include <dvbt/inner_coder.h>
+#include "inner_coder_impl.h"
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
 
 namespace gr {
   namespace dvbt {
 
+    /*
+     * Random blocks go through encode_block and through the bitwise
+     * encoder (generate_codeword of another instance) with puncturing
+     * as in EN 300 744 table 2 and packing of d_m bits per output byte.
+     * Encoder state is carried from one block to the next in both.
+     */
+    void
+    qa_inner_coder::compare_with_codeword(dvbt_constellation_t constellation, dvbt_code_rate_t coderate)
+    {
+      const int nblocks = 50;
+
+      dvbt_config config(constellation, gr::dvbt::NH, coderate, coderate);
+
+      inner_coder_impl coder(1, 1512, constellation, gr::dvbt::NH, coderate);
+      inner_coder_impl bitwise(1, 1512, constellation, gr::dvbt::NH, coderate);
+
+      // Bits of the mother code kept for each input bit of a period
+      const char * punct[7];
+      int k = config.d_cr_k;
+
+      switch (coderate)
+      {
+        case gr::dvbt::C2_3:
+          punct[0] = "XY"; punct[1] = "Y";
+          break;
+        case gr::dvbt::C3_4:
+          punct[0] = "XY"; punct[1] = "Y"; punct[2] = "X";
+          break;
+        case gr::dvbt::C5_6:
+          punct[0] = "XY"; punct[1] = "Y"; punct[2] = "X"; punct[3] = "Y"; punct[4] = "X";
+          break;
+        case gr::dvbt::C7_8:
+          punct[0] = "XY"; punct[1] = "Y"; punct[2] = "Y"; punct[3] = "Y";
+          punct[4] = "X"; punct[5] = "Y"; punct[6] = "X";
+          break;
+        case gr::dvbt::C1_2:
+        default:
+          punct[0] = "XY";
+          break;
+      }
+
+      const int m = config.d_m;
+      const int in_bs = (k * m) / 2;
+      const int out_bs = 4 * config.d_cr_n;
+
+      std::vector<unsigned char> in(in_bs), out(out_bs), bits;
+
+      srand(1);
+
+      for (int b = 0; b < nblocks; b++)
+      {
+        for (int i = 0; i < in_bs; i++)
+          in[i] = rand() & 0xff;
+
+        coder.encode_block(&in[0], &out[0]);
+
+        // Bitwise encoder, MSB first
+        bits.clear();
+
+        for (int i = 0; i < 8 * in_bs; i++)
+        {
+          int x, y;
+          bitwise.generate_codeword((in[i / 8] >> (7 - (i % 8))) & 1, x, y);
+
+          for (const char * c = punct[i % k]; *c; c++)
+            bits.push_back((*c == 'X') ? x : y);
+        }
+
+        CPPUNIT_ASSERT(bits.size() == (unsigned int)(out_bs * m));
+
+        for (int i = 0; i < out_bs; i++)
+        {
+          CPPUNIT_ASSERT((out[i] >> m) == 0);
+
+          for (int j = 0; j < m; j++)
+            CPPUNIT_ASSERT(((out[i] >> (m - 1 - j)) & 1) == bits[m * i + j]);
+        }
+      }
+    }
+
     void
     qa_inner_coder::t1()
     {
-        // Put test here
+      const dvbt_constellation_t constellations[] = {gr::dvbt::QPSK, gr::dvbt::QAM16, gr::dvbt::QAM64};
+      const dvbt_code_rate_t coderates[] = {gr::dvbt::C1_2, gr::dvbt::C2_3, gr::dvbt::C3_4, gr::dvbt::C5_6, gr::dvbt::C7_8};
+
+      for (int c = 0; c < 3; c++)
+        for (int r = 0; r < 5; r++)
+          compare_with_codeword(constellations[c], coderates[r]);
     }
 
   } /* namespace dvbt */
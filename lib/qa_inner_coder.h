@@ -24,6 +24,7 @@
 
 #include <cppunit/extensions/HelperMacros.h>
 #include <cppunit/TestCase.h>
+#include <dvbt/dvbt_config.h>
 
 namespace gr {
   namespace dvbt {
@@ -36,6 +37,7 @@ namespace gr {
       CPPUNIT_TEST_SUITE_END();
 
     private:
+      void compare_with_codeword(dvbt_constellation_t constellation, dvbt_code_rate_t coderate);
       void t1();
     };
 
@@ -0,0 +1,111 @@
+/* -*- c++ -*- */
+/* 
+ * Copyright 2013 <Bogdan Diaconescu, yo3iiu@yo3iiu.ro>.
+ * 
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ * 
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include "qa_ofdm_symbol_builder.h"
+#include <cppunit/TestAssert.h>
+
+#include <dvbt/ofdm_symbol_builder.h>
+#include "ofdm_symbol_builder_impl.h"
+#include "reference_signals_impl.h"
+#include "dvbt_map_impl.h"
+#include "symbol_inner_interleaver_impl.h"
+#include <vector>
+#include <stdlib.h>
+
+namespace gr {
+  namespace dvbt {
+
+    /*
+     * Random symbols go through ofdm_symbol_builder and through
+     * the chain it replaces: symbol_inner_interleaver (interleave),
+     * dvbt_map and reference_signals (pilot_gen). More than one frame
+     * is built so that all scattered pilot phases, both symbol parities
+     * and TPS of a new frame are checked.
+     */
+    void
+    qa_ofdm_symbol_builder::compare_with_chain(dvbt_constellation_t constellation, \
+        dvbt_transmission_mode_t transmission_mode)
+    {
+      const int nsymbols = 2 * SYMBOLS_PER_FRAME + 5;
+      const float gain = 1.0;
+
+      dvbt_config config(constellation, gr::dvbt::NH, gr::dvbt::C2_3, gr::dvbt::C2_3, \
+          gr::dvbt::G1_8, transmission_mode, 1, 0x55);
+
+      ofdm_symbol_builder_impl builder(constellation, gr::dvbt::NH, gr::dvbt::C2_3, gr::dvbt::C2_3, \
+          gr::dvbt::G1_8, transmission_mode, 1, 0x55, gain);
+
+      // Chain being replaced
+      pilot_gen pg(config);
+      const int * h = symbol_inner_interleaver_impl::H_table(transmission_mode);
+      gr_complex points[64];
+      dvbt_map_impl::make_constellation_points(points, config.d_constellation_size, \
+          config.d_step, config.d_alpha, gain * config.d_norm);
+
+      const int n = config.d_payload_length;
+      std::vector<unsigned char> in(n), interleaved(n);
+      std::vector<gr_complex> mapped(n), expected(config.d_fft_length), out(config.d_fft_length);
+
+      srand(1);
+
+      for (int s = 0; s < nsymbols; s++)
+      {
+        for (int q = 0; q < n; q++)
+          in[q] = rand() % config.d_constellation_size;
+
+        // symbol_inner_interleaver, interleave direction
+        for (int q = 0; q < n; q++)
+        {
+          if ((s % SYMBOLS_PER_FRAME) % 2)
+            interleaved[q] = in[h[q]];
+          else
+            interleaved[h[q]] = in[q];
+        }
+
+        // dvbt_map
+        for (int q = 0; q < n; q++)
+          mapped[q] = points[interleaved[q]];
+
+        // reference_signals
+        pg.update_output(&mapped[0], &expected[0]);
+
+        builder.build_symbol(&in[0], &out[0]);
+
+        for (int k = 0; k < config.d_fft_length; k++)
+          CPPUNIT_ASSERT(out[k] == expected[k]);
+      }
+    }
+
+    void
+    qa_ofdm_symbol_builder::t1()
+    {
+      compare_with_chain(gr::dvbt::QAM64, gr::dvbt::T2k);
+      compare_with_chain(gr::dvbt::QPSK, gr::dvbt::T2k);
+    }
+
+    void
+    qa_ofdm_symbol_builder::t2()
+    {
+      compare_with_chain(gr::dvbt::QAM16, gr::dvbt::T8k);
+    }
+
+  } /* namespace dvbt */
+} /* namespace gr */
@@ -23,14 +23,116 @@
 #include <cppunit/TestAssert.h>
 
 #include <dvbt/reference_signals.h>
+#include "reference_signals_impl.h"
+#include <vector>
+#include <stdlib.h>
 
 namespace gr {
   namespace dvbt {
 
+    /*
+     * TX symbols of pilot_gen (built from templates) are checked carrier
+     * by carrier against the construction of EN 300 744 clause 4.5:
+     * scattered pilots on k = Kmin + 3 * (l % 4) + 12p (get_spilot_value),
+     * continual pilots (get_cpilot_value), TPS pilots DBPSK modulated
+     * with the TPS bits of each frame starting from the w_k reference
+     * on the first symbol, payload on the remaining carriers in order.
+     * One superframe and a few more symbols are checked.
+     */
+    void
+    qa_reference_signals::compare_with_carriers(dvbt_constellation_t constellation, \
+        dvbt_transmission_mode_t transmission_mode)
+    {
+      const int nsymbols = FRAMES_PER_SUPERFRAME * SYMBOLS_PER_FRAME + 5;
+
+      dvbt_config config(constellation, gr::dvbt::NH, gr::dvbt::C2_3, gr::dvbt::C1_2, \
+          gr::dvbt::G1_8, transmission_mode, 1, 0x55);
+
+      pilot_gen pg(config);
+      // Only its tables are used
+      pilot_gen ref(config);
+
+      const int n = config.d_payload_length;
+      std::vector<gr_complex> in(n), out(ref.d_fft_length), tps(ref.d_tps_carriers_size);
+
+      srand(1);
+
+      for (int s = 0; s < nsymbols; s++)
+      {
+        const int l = s % SYMBOLS_PER_FRAME;
+        const int frame = (s / SYMBOLS_PER_FRAME) % FRAMES_PER_SUPERFRAME;
+
+        for (int i = 0; i < n; i++)
+          in[i] = gr_complex(rand() % 7 - 3, rand() % 7 - 3);
+
+        pg.update_output(&in[0], &out[0]);
+
+        ref.d_frame_index = frame;
+        ref.format_tps_data();
+
+        int payload = 0;
+
+        for (int i = 0; i < ref.d_fft_length; i++)
+        {
+          const int k = i - ref.d_zeros_on_left;
+          gr_complex expected(0.0, 0.0);
+          int pilot = 0;
+
+          if ((k < ref.d_Kmin) || (k > ref.d_Kmax))
+          {
+            CPPUNIT_ASSERT(out[i] == expected);
+            continue;
+          }
+
+          if (((k - ref.d_Kmin) % 12) == (3 * (l % 4)))
+          {
+            expected = ref.get_spilot_value(k);
+            pilot = 1;
+          }
+
+          for (int c = 0; c < ref.d_cpilot_carriers_size; c++)
+          {
+            if (ref.d_cpilot_carriers[c] == k)
+            {
+              expected = ref.get_cpilot_value(k);
+              pilot = 1;
+            }
+          }
+
+          for (int c = 0; c < ref.d_tps_carriers_size; c++)
+          {
+            if (ref.d_tps_carriers[c] == k)
+            {
+              if (l == 0)
+                tps[c] = gr_complex(2 * (0.5 - ref.d_wk[k]), 0);
+              else if (ref.d_tps_data[l] == 1)
+                tps[c] = -tps[c];
+
+              expected = tps[c];
+              pilot = 1;
+            }
+          }
+
+          if (!pilot)
+            expected = in[payload++];
+
+          CPPUNIT_ASSERT(out[i] == expected);
+        }
+
+        CPPUNIT_ASSERT(payload == n);
+      }
+    }
+
     void
     qa_reference_signals::t1()
     {
-        // Put test here
+      compare_with_carriers(gr::dvbt::QAM64, gr::dvbt::T2k);
+    }
+
+    void
+    qa_reference_signals::t2()
+    {
+      compare_with_carriers(gr::dvbt::QPSK, gr::dvbt::T8k);
     }
 
   } /* namespace dvbt */
@@ -24,6 +24,7 @@
 
 #include <cppunit/extensions/HelperMacros.h>
 #include <cppunit/TestCase.h>
+#include <dvbt/dvbt_config.h>
 
 namespace gr {
   namespace dvbt {
@@ -33,10 +34,13 @@ namespace gr {
     public:
       CPPUNIT_TEST_SUITE(qa_reference_signals);
       CPPUNIT_TEST(t1);
+      CPPUNIT_TEST(t2);
       CPPUNIT_TEST_SUITE_END();
 
     private:
+      void compare_with_carriers(dvbt_constellation_t constellation, dvbt_transmission_mode_t transmission_mode);
       void t1();
+      void t2();
     };
 
   } /* namespace dvbt */
@@ -28,6 +28,9 @@
 #include <stdio.h>
 #include <gnuradio/expj.h>
 #include <gnuradio/math.h>
+#include <volk/volk.h>
+
+#define USE_VOLK 1
 
 
 //#define TPS_DEBUG 1
@@ -45,6 +48,26 @@ namespace gr {
     const int pilot_gen::d_symbols_per_frame = SYMBOLS_PER_FRAME;
     //Number of frames in a superframe
     const int pilot_gen::d_frames_per_superframe = FRAMES_PER_SUPERFRAME;
+    //Max distance between two channel estimation carriers
+    const int pilot_gen::d_interp_max_step = 12;
+    //Lagrange cubic weights for t=1/3 between nodes 0 and 1 (nodes -1, 0, 1, 2)
+    //Weights for t=2/3 are the same ones in reverse order
+    const float pilot_gen::d_tf_weights[4] = {-5.0 / 81.0, 60.0 / 81.0, 30.0 / 81.0, -4.0 / 81.0};
+    //Max timing step (samples) and common phase change (rad) between
+    //symbols interpolated in time
+    const float pilot_gen::d_tf_max_step = 0.1;
+    const float pilot_gen::d_tf_max_phase = 0.1;
+    //Min coherence of continual pilots phase change to interpolate in time
+    const float pilot_gen::d_tf_min_coherence = 0.5;
+    //Min coherence of scattered pilots to accept the predicted phase
+    const float pilot_gen::d_spilot_min_coherence = 0.5;
+    //Symbols with same integer frequency offset needed to go in tracking
+    const int pilot_gen::d_freq_lock_symbols = 4;
+    //Symbols with other integer frequency offset needed to go back in acquisition
+    const int pilot_gen::d_freq_unlock_symbols = 3;
+    //PI loop gains - second order loop, damping 0.707, BnT 0.02
+    const float pilot_gen::d_pi_kp = 0.053;
+    const float pilot_gen::d_pi_ki = 0.0014;
 
     // 2k mode
     // Scattered pilots # of carriers
@@ -124,6 +147,8 @@ namespace gr {
     const int pilot_gen::d_tps_sync_odd[d_tps_sync_size] = {
       1, 1, 0, 0, 1, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 1
     };
+    // Max wrong bits in a received sync word, BCH check follows anyway
+    const int pilot_gen::d_tps_sync_max_errors = 1;
 
     /*
      * Constructor of class
@@ -137,6 +162,9 @@ namespace gr {
           d_frame_index(0),
           d_superframe_index(0),
           d_freq_offset_max(8),
+          d_freq_offset(0),
+          d_carrier_freq_correction(0),
+          d_sampling_freq_correction(0),
           d_trigger_index(0),
           d_payload_index(0),
           d_chanestim_index(0),
@@ -212,41 +240,162 @@ namespace gr {
         return;
       }
 
-      // Allocate buffer for continual pilots phase diffs
-      d_known_phase_diff = new float[d_cpilot_carriers_size - 1];
-      if (d_known_phase_diff == NULL)
+      // Allocate buffers for integer frequency offset search
+      d_cpilot_diff_size = d_Kmax - d_Kmin + 1 + 2 * d_freq_offset_max;
+
+      if (posix_memalign((void **)&d_cpilot_diff, volk_get_alignment(), sizeof(gr_complex) * d_cpilot_diff_size))
       {
-        std::cout << "error allocating d_tps_carriers_val" << std::endl;
+        std::cout << "cannot allocate memory: d_cpilot_diff" << std::endl;
         return;
       }
 
-      // Obtain phase diff for all continual pilots
-      for (int i = 0; i < (d_cpilot_carriers_size - 1); i++)
+      d_cpilot_comb = new gr_complex[2 * d_freq_offset_max];
+      if (d_cpilot_comb == NULL)
       {
-        d_known_phase_diff[i] = \
-          norm(get_cpilot_value(d_cpilot_carriers[i + 1]) - get_cpilot_value(d_cpilot_carriers[i]));
+        std::cout << "error allocating d_cpilot_comb" << std::endl;
+        return;
       }
 
-      d_cpilot_phase_diff = new float[d_cpilot_carriers_size - 1];
-      if (d_cpilot_phase_diff == NULL)
+      // Continual pilots of previous symbol, used by frequency tracking
+      d_prev_cpilots = new gr_complex[d_cpilot_carriers_size];
+      if (d_prev_cpilots == NULL)
       {
-        std::cout << "error allocating d_tps_carriers_val" << std::endl;
+        std::cout << "error allocating d_prev_cpilots" << std::endl;
         return;
       }
 
-      // Allocate buffer for deroated input symbol
-      d_derot_in = new gr_complex[d_fft_length];
-      if (d_derot_in == NULL)
+      // Mean position of continual pilots in both halves
+      d_symbol_ratio = 1.0 + (float)d_cp_length / (float)d_fft_length;
+      d_cpilot_left_pos = 0; d_cpilot_right_pos = 0;
+
+      int half_size = d_cpilot_carriers_size / 2;
+
+      for (int j = 0; j < d_cpilot_carriers_size; j++)
+      {
+        float pos = (float)(d_zeros_on_left + d_cpilot_carriers[j] - d_fft_length / 2);
+
+        if (j < half_size)
+          d_cpilot_left_pos += pos / half_size;
+        else
+          d_cpilot_right_pos += pos / (d_cpilot_carriers_size - half_size);
+      }
+
+      reset_frequency_tracking();
+
+      const int alignment = volk_get_alignment();
+
+      // Allocate ring of derotated input symbols
+      if (posix_memalign((void **)&d_tf_in[0], alignment, sizeof(gr_complex) * 4 * d_fft_length))
       {
-        std::cout << "error allocating d_derot_in" << std::endl;
+        std::cout << "cannot allocate memory: d_tf_in" << std::endl;
         return;
       }
 
-      // allocate buffer for first tps symbol constellation
-      d_tps_carriers_val = new gr_complex[d_tps_carriers_size];
-      if (d_tps_carriers_val == NULL)
+      for (int i = 0; i < 4; i++)
       {
-        std::cout << "error allocating d_tps_carriers_val" << std::endl;
+        d_tf_in[i] = d_tf_in[0] + i * d_fft_length;
+        d_tf_symbol_index[i] = -1;
+        d_tf_frame_index[i] = -1;
+        d_tf_mod_index[i] = -1;
+      }
+
+      d_tf_slot = 0;
+      d_derot_in = d_tf_in[0];
+
+      // Allocate buffer for equalized symbol
+      if (posix_memalign((void **)&d_equalized, alignment, sizeof(gr_complex) * (d_Kmax - d_Kmin + 1)))
+      {
+        std::cout << "cannot allocate memory: d_equalized" << std::endl;
+        return;
+      }
+
+      // Reciprocals used by linear interpolation of channel gains
+      d_interp_recip = new float[d_interp_max_step + 1];
+      if (d_interp_recip == NULL)
+      {
+        std::cout << "error allocating d_interp_recip" << std::endl;
+        return;
+      }
+
+      d_interp_recip[0] = 0;
+      for (int i = 1; i <= d_interp_max_step; i++)
+        d_interp_recip[i] = 1.0 / (float)i;
+
+      // Time-frequency channel estimator grid (each third carrier)
+      d_tf_grid_size = (d_Kmax - d_Kmin) / 3 + 1;
+      d_tf_symbols = 0;
+
+      if (posix_memalign((void **)&d_tf_grid, alignment, sizeof(gr_complex) * d_tf_grid_size))
+      {
+        std::cout << "cannot allocate memory: d_tf_grid" << std::endl;
+        return;
+      }
+      memset(d_tf_grid, 0, sizeof(gr_complex) * d_tf_grid_size);
+
+      if (posix_memalign((void **)&d_tf_third, alignment, sizeof(gr_complex) * d_tf_grid_size))
+      {
+        std::cout << "cannot allocate memory: d_tf_third" << std::endl;
+        return;
+      }
+
+      if (posix_memalign((void **)&d_tf_two_thirds, alignment, sizeof(gr_complex) * d_tf_grid_size))
+      {
+        std::cout << "cannot allocate memory: d_tf_two_thirds" << std::endl;
+        return;
+      }
+
+      if (posix_memalign((void **)&d_tf_tmp, alignment, sizeof(gr_complex) * d_tf_grid_size))
+      {
+        std::cout << "cannot allocate memory: d_tf_tmp" << std::endl;
+        return;
+      }
+
+      if (posix_memalign((void **)&d_tf_lin, alignment, sizeof(gr_complex) * d_tf_grid_size))
+      {
+        std::cout << "cannot allocate memory: d_tf_lin" << std::endl;
+        return;
+      }
+
+      if (posix_memalign((void **)&d_tf_cur, alignment, sizeof(gr_complex) * d_tf_grid_size))
+      {
+        std::cout << "cannot allocate memory: d_tf_cur" << std::endl;
+        return;
+      }
+      memset(d_tf_cur, 0, sizeof(gr_complex) * d_tf_grid_size);
+
+      if (posix_memalign((void **)&d_tf_old, alignment, sizeof(gr_complex) * d_tf_grid_size))
+      {
+        std::cout << "cannot allocate memory: d_tf_old" << std::endl;
+        return;
+      }
+      memset(d_tf_old, 0, sizeof(gr_complex) * d_tf_grid_size);
+
+      // Grid node j has a scattered pilot on symbols with phase j % 4.
+      // For an equalized symbol with phase p the last pilot is
+      // a = (j - p) % 4 symbols after it and the previous one 4 - a
+      // symbols before it, so the previous gain has weight a / 4.
+      if (posix_memalign((void **)&d_tf_time_w[0], alignment, sizeof(float) * 4 * 2 * d_tf_grid_size))
+      {
+        std::cout << "cannot allocate memory: d_tf_time_w" << std::endl;
+        return;
+      }
+
+      for (int p = 0; p < 4; p++)
+      {
+        d_tf_time_w[p] = d_tf_time_w[0] + p * 2 * d_tf_grid_size;
+
+        for (int j = 0; j < d_tf_grid_size; j++)
+        {
+          float w = (float)((j - p + 4) % 4) / 4.0;
+          d_tf_time_w[p][2 * j] = w;
+          d_tf_time_w[p][2 * j + 1] = w;
+        }
+      }
+
+      d_tf_cpilots = new gr_complex[d_cpilot_carriers_size];
+      if (d_tf_cpilots == NULL)
+      {
+        std::cout << "error allocating d_tf_cpilots" << std::endl;
         return;
       }
 
@@ -274,35 +423,78 @@ namespace gr {
       }
       memset(d_tps_symbol, 0, d_tps_carriers_size * sizeof(gr_complex));
 
-      // Init receive TPS data vector
-      for (int i = 0; i < d_symbols_per_frame; i++)
-        d_rcv_tps_data.push_back(0);
+      // Init receive TPS data register
+      d_rcv_tps_lo = 0; d_rcv_tps_hi = 0;
+      d_rcv_tps_valid_lo = 0; d_rcv_tps_valid_hi = 0;
+
+      // Init TPS sync words
+      d_tps_sync_even_word = 0; d_tps_sync_odd_word = 0;
 
-      // Init TPS sync sequence
       for (int i = 0; i < d_tps_sync_size; i++)
       {
-        d_tps_sync_evenv.push_back(d_tps_sync_even[i]);
-        d_tps_sync_oddv.push_back(d_tps_sync_odd[i]);
+        d_tps_sync_even_word |= d_tps_sync_even[i] << i;
+        d_tps_sync_odd_word |= d_tps_sync_odd[i] << i;
       }
 
-      // Allocate buffer for channel estimation carriers
-      d_chanestim_carriers = new int[d_Kmax - d_Kmin + 1];
-      if (d_chanestim_carriers == NULL)
+      init_bch_table();
+
+      d_tps_word = 0;
+      d_tps_word_new = 0;
+
+      // Allocate carrier maps for all scattered pilot phases
+      d_spilot_map[0] = new int[4 * (d_Kmax - d_Kmin + 1)];
+      if (d_spilot_map[0] == NULL)
       {
-        std::cout << "error allocating d_tps_data" << std::endl;
+        std::cout << "error allocating d_spilot_map" << std::endl;
         return;
       }
 
-      // Allocate buffer for payload carriers
-      d_payload_carriers = new int[d_Kmax - d_Kmin + 1];
-      if (d_payload_carriers == NULL)
+      d_chanestim_map[0] = new int[4 * (d_Kmax - d_Kmin + 1)];
+      if (d_chanestim_map[0] == NULL)
       {
-        std::cout << "error allocating d_tps_data" << std::endl;
+        std::cout << "error allocating d_chanestim_map" << std::endl;
+        return;
+      }
+
+      d_payload_map[0] = new int[4 * (d_Kmax - d_Kmin + 1)];
+      if (d_payload_map[0] == NULL)
+      {
+        std::cout << "error allocating d_payload_map" << std::endl;
+        return;
+      }
+
+      d_spilot_sign[0] = new float[4 * (d_Kmax - d_Kmin + 1)];
+      if (d_spilot_sign[0] == NULL)
+      {
+        std::cout << "error allocating d_spilot_sign" << std::endl;
         return;
       }
-      
+
+      if (posix_memalign((void **)&d_spilot_rx, volk_get_alignment(), sizeof(gr_complex) * (d_Kmax - d_Kmin + 1)))
+      {
+        std::cout << "cannot allocate memory: d_spilot_rx" << std::endl;
+        return;
+      }
+
+      if (posix_memalign((void **)&d_spilot_prod, volk_get_alignment(), sizeof(gr_complex) * (d_Kmax - d_Kmin + 1)))
+      {
+        std::cout << "cannot allocate memory: d_spilot_prod" << std::endl;
+        return;
+      }
+
+      build_carrier_maps();
+
+      d_chanestim_carriers = d_chanestim_map[0];
+      d_payload_carriers = d_payload_map[0];
+
+      // TX symbol templates are built on first TX symbol
+      d_tx_template[0] = NULL;
+      d_tx_tps_sign = NULL;
+      d_tx_params = -1;
+
       // Reset the pilot generator
       reset_pilot_generator();
+
       // Format TPS data with current values
       format_tps_data();
     }
@@ -313,16 +505,34 @@ namespace gr {
     pilot_gen::~pilot_gen()
     {
       delete [] d_wk;
-      delete [] d_tps_carriers_val;
       delete [] d_tps_data;
       delete [] d_prev_tps_symbol;
       delete [] d_tps_symbol;
       delete [] d_spilot_carriers_val;
       delete [] d_channel_gain;
-      delete [] d_known_phase_diff;
-      delete [] d_payload_carriers;
-      delete [] d_chanestim_carriers;
-      delete [] d_derot_in;
+      delete [] d_spilot_map[0];
+      delete [] d_chanestim_map[0];
+      delete [] d_payload_map[0];
+      delete [] d_spilot_sign[0];
+      free(d_tx_template[0]);
+      delete [] d_tx_tps_sign;
+      free(d_spilot_rx);
+      free(d_spilot_prod);
+      free(d_tf_in[0]);
+      delete [] d_interp_recip;
+      delete [] d_prev_cpilots;
+      free(d_cpilot_diff);
+      delete [] d_cpilot_comb;
+      free(d_equalized);
+      free(d_tf_grid);
+      free(d_tf_third);
+      free(d_tf_two_thirds);
+      free(d_tf_tmp);
+      free(d_tf_lin);
+      free(d_tf_cur);
+      free(d_tf_old);
+      free(d_tf_time_w[0]);
+      delete [] d_tf_cpilots;
     }
 
     /*
@@ -345,83 +555,97 @@ namespace gr {
     }
 
     /*
-     * Generate shortened BCH(67, 53) codes from TPS data
-     * Extend the code with 60 bits and use BCH(127, 113)
+     * Init table used by BCH code computation
+     * The BCH code is computed with a shift register shifting to the right
+     * (first bit in on bit 0), so 8 bits can be processed at once
+     * as for a reflected CRC.
+     * X^14+X^9+X^8+X^6+X^5+X^4+X^2+X+1
      */
     void
-    pilot_gen::generate_bch_code()
+    pilot_gen::init_bch_table()
     {
-      //TODO
-      //DO other way: if (feedback == 1) reg = reg ^ polymomial
-      //else nothing
+      // Polynomial reflected (without X^14)
+      const unsigned int poly = 0x3bb0;
 
-      //(n, k) = (127, 113) = (60+67, 60+53)
-      unsigned int reg_bch = 0;
-      unsigned char data_in[113];
+      for (int i = 0; i < 256; i++)
+      {
+        unsigned int reg = i;
 
-      //fill in 60 zeros
-      memset(&data_in[0], 0, 60);
-      //fill in TPS data - start bit not included
-      memcpy(&data_in[60], &d_tps_data[1], 53);
+        for (int j = 0; j < 8; j++)
+          reg = (reg >> 1) ^ ((reg & 1) ? poly : 0);
 
-      //X^14+X^9+X^8+X^6+X^5+X^4+X^2+X+1
-      for (int i = 0; i < 113; i++)
-      {
-        int feedback = 0x1 & (data_in[i] ^ reg_bch);
-        reg_bch  = reg_bch >> 1;
-        reg_bch |= feedback << 13;
-        reg_bch = reg_bch \
-            ^ (feedback << 12) ^ (feedback << 11) \
-            ^ (feedback << 9) ^ (feedback << 8) \
-            ^ (feedback << 7) ^ (feedback << 5) \
-            ^ (feedback << 4);
+        d_bch_table[i] = reg;
       }
-
-      for (int i = 0; i < 14; i++)
-        d_tps_data[i + 54] = 0x1 & (reg_bch >> i); 
     }
 
-    int
-    pilot_gen::verify_bch_code(std::deque<char> data)
+    /*
+     * Compute the 14 parity bits of shortened BCH(67, 53) code
+     * Data s1-s53 are on bits 0-52, parity s54-s67 is returned on bits 0-13.
+     * The code is BCH(127, 113) with 60 leading zero bits, which do not
+     * change the register.
+     */
+    unsigned int
+    pilot_gen::bch_parity(uint64_t data)
     {
-      int ret = 0;
+      unsigned int reg = 0;
+
+      // 48 bits using the table
+      for (int i = 0; i < 6; i++)
+      {
+        reg ^= (data >> (8 * i)) & 0xff;
+        reg = (reg >> 8) ^ d_bch_table[reg & 0xff];
+      }
+
+      // Last 5 bits
+      for (int i = 48; i < 53; i++)
+      {
+        int feedback = ((data >> i) ^ reg) & 1;
+        reg = (reg >> 1) ^ (feedback ? 0x3bb0 : 0);
+      }
 
-      //TODO
-      //DO other way: if (feedback == 1) reg = reg ^ polymomial
-      //else nothing
+      return reg;
+    }
 
-      //(n, k) = (127, 113) = (60+67, 60+53)
-      unsigned int reg_bch = 0;
-      unsigned char data_in[113];
+    /*
+     * Generate shortened BCH(67, 53) codes from TPS data
+     * Extend the code with 60 bits and use BCH(127, 113)
+     */
+    void
+    pilot_gen::generate_bch_code()
+    {
+      uint64_t data = 0;
 
-      //fill in 60 zeros
-      memset(&data_in[0], 0, 60);
-      //fill in TPS data - start bit not included
-      //memcpy(&data_in[60], &data[1], 53);
+      // TPS data - start bit not included
       for (int i = 0; i < 53; i++)
-        data_in[60 + i] = data[1 + i]; 
+        data |= (uint64_t)(d_tps_data[i + 1] & 1) << i;
 
-      //X^14+X^9+X^8+X^6+X^5+X^4+X^2+X+1
-      for (int i = 0; i < 113; i++)
-      {
-        int feedback = 0x1 & (data_in[i] ^ reg_bch);
-        reg_bch  = reg_bch >> 1;
-        reg_bch |= feedback << 13;
-        reg_bch = reg_bch \
-            ^ (feedback << 12) ^ (feedback << 11) \
-            ^ (feedback << 9) ^ (feedback << 8) \
-            ^ (feedback << 7) ^ (feedback << 5) \
-            ^ (feedback << 4);
-      }
+      unsigned int parity = bch_parity(data);
 
       for (int i = 0; i < 14; i++)
-        if (data[i + 54] != (0x1 & (reg_bch >> i)))
-        {
-          ret = -1;
-          break;
-        }
+        d_tps_data[i + 54] = 0x1 & (parity >> i);
+    }
+
+    int
+    pilot_gen::verify_bch_code()
+    {
+      // s1-s53 are on bits 1-53, s54-s67 on bits 54-67
+      uint64_t data = (d_rcv_tps_lo >> 1) & (((uint64_t)1 << 53) - 1);
+      unsigned int parity = ((d_rcv_tps_lo >> 54) | (d_rcv_tps_hi << 10)) & 0x3fff;
+
+      return (bch_parity(data) == parity) ? 0 : -1;
+    }
+
+    /*
+     * Shift in a new TPS bit at position 67
+     */
+    void
+    pilot_gen::shift_tps_bit(int bit, int valid)
+    {
+      d_rcv_tps_lo = (d_rcv_tps_lo >> 1) | ((uint64_t)(d_rcv_tps_hi & 1) << 63);
+      d_rcv_tps_hi = (d_rcv_tps_hi >> 1) | ((bit & 1) << 3);
 
-      return ret;
+      d_rcv_tps_valid_lo = (d_rcv_tps_valid_lo >> 1) | ((uint64_t)(d_rcv_tps_valid_hi & 1) << 63);
+      d_rcv_tps_valid_hi = (d_rcv_tps_valid_hi >> 1) | ((valid & 1) << 3);
     }
 
     void
@@ -460,13 +684,65 @@ namespace gr {
     }
 
     /*
-     * Init scattered pilot generator
+     * Build carrier maps for all 4 scattered pilot phases
+     * en 300 744 - section 4.5.3
+     * Scattered pilots are on k = Kmin + 3 * (l % 4) + 12p,
+     * continual and TPS pilots are on the same carriers in all symbols.
      */
-    int
-    pilot_gen::get_current_spilot(int sindex) const
+    void
+    pilot_gen::build_carrier_maps()
     {
-      //TODO - can be optimized for same symbol_index
-      return (d_Kmin + 3 * (sindex % 4) + 12 * d_spilot_index);
+      const int ncarriers = d_Kmax - d_Kmin + 1;
+      std::vector<char> is_cpilot(ncarriers, 0);
+      std::vector<char> is_tpilot(ncarriers, 0);
+
+      for (int i = 0; i < d_cpilot_carriers_size; i++)
+        is_cpilot[d_cpilot_carriers[i]] = 1;
+
+      for (int i = 0; i < d_tps_carriers_size; i++)
+        is_tpilot[d_tps_carriers[i]] = 1;
+
+      for (int phase = 0; phase < 4; phase++)
+      {
+        d_spilot_map[phase] = d_spilot_map[0] + phase * ncarriers;
+        d_chanestim_map[phase] = d_chanestim_map[0] + phase * ncarriers;
+        d_payload_map[phase] = d_payload_map[0] + phase * ncarriers;
+
+        d_spilot_map_size[phase] = 0;
+        d_chanestim_map_size[phase] = 0;
+        d_payload_map_size[phase] = 0;
+
+        for (int k = 0; k < ncarriers; k++)
+        {
+          int is_spilot = ((k - 3 * phase) % 12) == 0;
+
+          if (is_spilot)
+            d_spilot_map[phase][d_spilot_map_size[phase]++] = k;
+
+          // Both scattered and continual pilots are used
+          // for channel estimation
+          if (is_spilot || is_cpilot[k])
+            d_chanestim_map[phase][d_chanestim_map_size[phase]++] = k;
+
+          if (!is_spilot && !is_cpilot[k] && !is_tpilot[k])
+            d_payload_map[phase][d_payload_map_size[phase]++] = k;
+        }
+
+        // Sign of products of adjacent scattered pilots
+        d_spilot_sign[phase] = d_spilot_sign[0] + phase * ncarriers;
+
+        for (int i = 0; i < (d_spilot_map_size[phase] - 1); i++)
+        {
+          int k = d_spilot_map[phase][i];
+          int next = d_spilot_map[phase][i + 1];
+
+          d_spilot_sign[phase][i] = (d_wk[k] == d_wk[next]) ? 1.0 : -1.0;
+        }
+
+        if (d_payload_map_size[phase] != d_payload_length)
+          std::cout << "error: payload carriers: " << d_payload_map_size[phase] \
+            << " for phase: " << phase << std::endl;
+      }
     }
 
     gr_complex
@@ -488,212 +764,355 @@ namespace gr {
       // Gain gval=rxval/txval
       d_channel_gain[spilot] = gr_complex((4 * 2 * (0.5 - d_wk[spilot]) / 3), 0) / val;
     }
+
+    /*
+     * Equalize all useful carriers of a symbol with the channel gains.
+     * Payload and TPS carriers are then gathered from d_equalized.
+     */
     void
-    pilot_gen::advance_spilot(int sindex)
+    pilot_gen::equalize(const gr_complex * in)
     {
-      //TODO - do in a simpler way?
-      int size = d_spilot_carriers_size;
-
-      if (sindex == 0)
-        size = d_spilot_carriers_size + 1;
-
-      // TODO - fix this - what value should we use?
-      d_spilot_index = (++d_spilot_index) % size;
+#ifdef USE_VOLK
+      volk_32fc_x2_multiply_32fc_u(d_equalized, &in[d_zeros_on_left], d_channel_gain, d_Kmax - d_Kmin + 1);
+#else
+      for (int k = 0; k < (d_Kmax - d_Kmin + 1); k++)
+        d_equalized[k] = in[d_zeros_on_left + k] * d_channel_gain[k];
+#endif
     }
 
-    int
-    pilot_gen::get_first_spilot()
+    /*
+     * Keep the last two gains of each third carrier with the scattered
+     * pilots of current symbol. Each third carrier has a scattered pilot
+     * every 4 symbols.
+     * Time interpolation needs a channel that changes slowly: continual
+     * pilots of current and previous symbol give the phase change on both
+     * halves of the spectrum, common part is a carrier phase change and
+     * the difference between halves is a timing step. A large change
+     * (or a lost symbol) starts the history again.
+     */
+    void
+    pilot_gen::update_tf_grid(const gr_complex * in, int diff_symbol_index)
     {
-      d_spilot_index = 0;
+      gr_complex left = gr_complex(0.0, 0.0), right = gr_complex(0.0, 0.0);
+      float left_energy = 0, right_energy = 0;
+      int half_size = d_cpilot_carriers_size / 2;
 
-      return (d_Kmin + 3 * (d_symbol_index % 4));
-    }
+      for (int i = 0; i < d_cpilot_carriers_size; i++)
+      {
+        gr_complex c = in[d_zeros_on_left + d_cpilot_carriers[i]];
+        gr_complex d = c * std::conj(d_tf_cpilots[i]);
 
-    int
-    pilot_gen::get_last_spilot() const
-    {
-      int size = d_spilot_carriers_size - 1;
+        if (i < half_size)
+        {
+          left += d; left_energy += std::abs(d);
+        }
+        else
+        {
+          right += d; right_energy += std::abs(d);
+        }
 
-      if (d_symbol_index == 0)
-        size = d_spilot_carriers_size;
+        d_tf_cpilots[i] = c;
+      }
 
-      return (d_Kmin + 3 * (d_symbol_index % 4) + 12 * size);
-    }
+      float left_angle = std::arg(left);
+      float right_angle = std::arg(right);
 
-    int
-    pilot_gen::get_next_spilot()
-    {
-      int pilot = (d_Kmin + 3 * (d_symbol_index % 4) + 12 * (++d_spilot_index));
+      // Common phase change and timing step in samples
+      float phase = (left_angle + right_angle) / 2;
+      float step = (right_angle - left_angle) / (d_cpilot_right_pos - d_cpilot_left_pos) \
+        * d_fft_length / (2 * M_PI);
+
+      if ((diff_symbol_index != 1) || \
+          (std::abs(left) < d_tf_min_coherence * left_energy) || \
+          (std::abs(right) < d_tf_min_coherence * right_energy) || \
+          (std::abs(phase) > d_tf_max_phase) || (std::abs(step) > d_tf_max_step))
+        d_tf_symbols = 0;
+
+      // 7 symbols cover the pilots around the oldest symbol of the ring
+      if (d_tf_symbols < 7)
+        d_tf_symbols++;
+
+      const int n = d_spilot_map_size[d_mod_symbol_index];
+      const int * map = d_spilot_map[d_mod_symbol_index];
 
-      if (pilot > d_Kmax)
-        pilot = d_Kmax;
+      for (int i = 0; i < n; i++)
+      {
+        int k = map[i];
 
-      return pilot;
+        d_tf_old[k / 3] = d_tf_cur[k / 3];
+        d_tf_cur[k / 3] = get_spilot_value(k) / in[d_zeros_on_left + k];
+      }
     }
 
-    int
-    pilot_gen::process_spilot_data(const gr_complex * in)
+    /*
+     * Channel gain of the symbol in slot (3 symbols before current one).
+     * Each third carrier is interpolated linearly in time between its
+     * scattered pilots before and after the symbol, continual pilots are
+     * measured on the symbol itself, then the grid is interpolated in
+     * frequency.
+     * Until the history covers the symbol the gain is interpolated
+     * linearly in frequency between the pilots of the symbol only.
+     */
+    void
+    pilot_gen::estimate_channel(int slot)
     {
-      // This is channel estimator
-      // Interpolate the gain between carriers to obtain
-      // gain for non pilot carriers - we use linear interpolation
-            
-      /*************************************************************/
-      // Find out the OFDM symbol index (value 0 to 3) sent
-      // in current block by correlating scattered symbols with
-      // current block - result is (symbol index % 4)
-      /*************************************************************/
-      float max = 0; float sum = 0;
- 
-      for (int scount = 0; scount < 4; scount++)
+      const gr_complex * in = &d_tf_in[slot][d_zeros_on_left];
+      const int phase = d_tf_mod_index[slot];
+
+      if (d_tf_symbols < 7)
       {
-        d_spilot_index = 0; d_cpilot_index = 0;
-        d_chanestim_index = 0;
+        d_chanestim_carriers = d_chanestim_map[phase];
+        d_chanestim_index = d_chanestim_map_size[phase];
 
-        for (int k = 0; k < (d_Kmax - d_Kmin + 1); k++)
+        for (int i = 0; i < d_chanestim_index; i++)
         {
-          // Keep data for channel estimation
-          if (k == get_current_spilot(scount))
-          {
-            set_chanestim_carrier(k);
-            advance_spilot(scount); 
-            advance_chanestim();
-          }
+          int k = d_chanestim_carriers[i];
+          set_channel_gain(k, in[k]);
         }
-        //printf("d_chanestim_index: %i\n", d_chanestim_index);
 
-        gr_complex c = gr_complex(0.0, 0.0);
+        interpolate_linear();
+        return;
+      }
 
-        // This should be of range 0 to d_chanestim_index bit for now we use just a 
-        // small number of spilots to obtain the symbol index
-        for (int j = 0; j < 10; j++)
-        {
-          c += get_spilot_value(d_chanestim_carriers[j]) * conj(in[d_zeros_on_left + d_chanestim_carriers[j]]);
-        }
-        sum = norm(c);
+      // grid = cur + (old - cur) * w
+#ifdef USE_VOLK
+      float * tmp = (float *) d_tf_tmp;
 
-        //printf("sum: %f, max: %f, scount: %i\n", sum, max, scount);
-        if (sum > max)
-        {
-          max = sum;
-          d_mod_symbol_index = scount;
-        }
+      volk_32f_x2_subtract_32f_a(tmp, (const float *) d_tf_old, (const float *) d_tf_cur, 2 * d_tf_grid_size);
+      volk_32f_x2_multiply_32f_a(tmp, tmp, d_tf_time_w[phase], 2 * d_tf_grid_size);
+      volk_32f_x2_add_32f_a((float *) d_tf_grid, (const float *) d_tf_cur, tmp, 2 * d_tf_grid_size);
+#else
+      for (int j = 0; j < d_tf_grid_size; j++)
+        d_tf_grid[j] = d_tf_cur[j] + (d_tf_old[j] - d_tf_cur[j]) * d_tf_time_w[phase][2 * j];
+#endif
+
+      for (int i = 0; i < d_cpilot_carriers_size; i++)
+      {
+        int k = d_cpilot_carriers[i];
+        d_tf_grid[k / 3] = get_cpilot_value(k) / in[k];
+      }
+
+      interpolate_tf_grid();
     }
 
-#if 1
-    //printf("sindex: %i, d_trigger_index: %i\n", sindex, d_trigger_index);
+    /*
+     * Frequency interpolation of the grid to all carriers.
+     * Uses a cubic (4 taps) Lagrange interpolator for the two carriers
+     * between nodes and linear interpolation on both ends.
+     */
+    void
+    pilot_gen::interpolate_tf_grid()
+    {
+      const int n = d_tf_grid_size - 3;
+      const gr_complex * g = d_tf_grid;
 
-    /*************************************************************/
-    // Keep data for channel estimator
-    // This method interpolates scattered measurements across one OFDM symbol
-    // It does not use measurements from the previous OFDM symnbols (does not use history)
-    // as it may have encountered a phase change for the current phase only
-    /*************************************************************/
+#ifdef USE_VOLK
+      // Work on interleaved floats, weights are real
+      float * third = (float *) d_tf_third;
+      float * two_thirds = (float *) d_tf_two_thirds;
+      float * tmp = (float *) d_tf_tmp;
 
-    d_spilot_index = 0; d_cpilot_index = 0;
-    d_chanestim_index = 0;
+      volk_32f_s32f_multiply_32f_a(third, (const float *) &g[0], d_tf_weights[0], 2 * n);
+      volk_32f_s32f_multiply_32f_a(two_thirds, (const float *) &g[0], d_tf_weights[3], 2 * n);
 
-    for (int k = 0; k < (d_Kmax - d_Kmin + 1); k++)
-    {
-      // Keep data for channel estimation
-      if (k == get_current_spilot(d_mod_symbol_index))
+      for (int t = 1; t < 4; t++)
+      {
+        volk_32f_s32f_multiply_32f_u(tmp, (const float *) &g[t], d_tf_weights[t], 2 * n);
+        volk_32f_x2_add_32f_a(third, third, tmp, 2 * n);
+        volk_32f_s32f_multiply_32f_u(tmp, (const float *) &g[t], d_tf_weights[3 - t], 2 * n);
+        volk_32f_x2_add_32f_a(two_thirds, two_thirds, tmp, 2 * n);
+      }
+#else
+      for (int i = 0; i < n; i++)
       {
-        set_chanestim_carrier(k);
-        advance_spilot(d_mod_symbol_index); 
-        advance_chanestim();
+        d_tf_third[i] = d_tf_weights[0] * g[i] + d_tf_weights[1] * g[i + 1] \
+          + d_tf_weights[2] * g[i + 2] + d_tf_weights[3] * g[i + 3];
+        d_tf_two_thirds[i] = d_tf_weights[3] * g[i] + d_tf_weights[2] * g[i + 1] \
+          + d_tf_weights[1] * g[i + 2] + d_tf_weights[0] * g[i + 3];
       }
+#endif
+
+      d_channel_gain[0] = g[0];
 
-      // Keep data for channel estimation
-      if (k == get_current_cpilot())
+      // Linear on first segment
+      d_channel_gain[1] = (2.0f * g[0] + g[1]) * d_interp_recip[3];
+      d_channel_gain[2] = (g[0] + 2.0f * g[1]) * d_interp_recip[3];
+
+      for (int i = 0; i < n; i++)
       {
-        set_chanestim_carrier(k);
-        advance_cpilot();
-        advance_chanestim();
+        d_channel_gain[3 * i + 3] = g[i + 1];
+        d_channel_gain[3 * i + 4] = d_tf_third[i];
+        d_channel_gain[3 * i + 5] = d_tf_two_thirds[i];
       }
-    }
- 
-    // We use both scattered pilots and continual pilots
-    for (int i = 0, startk = d_chanestim_carriers[0]; i < d_chanestim_index; i++)
-    {
-      // Get a carrier from the list of carriers
-      // used for channel estimation
-      int k = d_chanestim_carriers[i];
 
-      set_channel_gain(k, in[k + d_zeros_on_left]);
+      // Linear on last segment
+      const int m = d_tf_grid_size - 2;
+      d_channel_gain[3 * m] = g[m];
+      d_channel_gain[3 * m + 1] = (2.0f * g[m] + g[m + 1]) * d_interp_recip[3];
+      d_channel_gain[3 * m + 2] = (g[m] + 2.0f * g[m + 1]) * d_interp_recip[3];
+      d_channel_gain[3 * m + 3] = g[m + 1];
+    }
 
-      // Calculate tg(alpha) due to linear interpolation
-      gr_complex tg_alpha = (d_channel_gain[k] - d_channel_gain[startk]) / gr_complex(11.0, 0.0);
+    /*
+     * Linear interpolation of the channel gain between
+     * the pilots of current symbol.
+     * All pilots are on each third carrier, so the ramps are first done
+     * on the grid nodes only, then carriers between nodes are
+     * 1/3 and 2/3 of the step for the whole symbol at once.
+     */
+    void
+    pilot_gen::interpolate_linear()
+    {
+      gr_complex * g = d_tf_lin;
+      const int n = d_tf_grid_size - 1;
 
-      //printf("tg_alpha: re: %f, img: %f\n", tg_alpha.real(), tg_alpha.imag());
+      g[d_chanestim_carriers[0] / 3] = d_channel_gain[d_chanestim_carriers[0]];
 
-      // Calculate interpolation for all intermediate values
-      for (int j = 1; j < (k - startk); j++)
+      for (int i = 1, startk = d_chanestim_carriers[0]; i < d_chanestim_index; i++)
       {
-        gr_complex current = d_channel_gain[startk] + tg_alpha * gr_complex(j, 0.0);
-        d_channel_gain[startk + j] = current;
+        int k = d_chanestim_carriers[i];
 
-        //printf("currentgain[%i]: re: %f, img: %f\n", j, current.real(), current.imag());
-        //printf("d_symbol_index: %i, set_d_channel_gain[%i]: re: %f, img: %f\n", \
-          d_symbol_index, startk + j, d_channel_gain[startk + j].real(), d_channel_gain[startk + j].imag());
-      }
+        // Calculate tg(alpha) due to linear interpolation
+        // Step between pilots is at most d_interp_max_step / 3 nodes
+        int step = (k - startk) / 3;
+        gr_complex tg_alpha = (d_channel_gain[k] - d_channel_gain[startk]) * d_interp_recip[step];
 
-      startk = k;
-    }
+        // Calculate interpolation for all intermediate nodes
+        // going in fixed steps from the left pilot
+        gr_complex current = d_channel_gain[startk];
+
+        for (int j = 1; j < step; j++)
+        {
+          current += tg_alpha;
+          g[startk / 3 + j] = current;
+        }
 
-    // Signal that equalizer is ready
-    d_equalizer_ready = 1;
+        g[k / 3] = d_channel_gain[k];
+        startk = k;
+      }
 
+#ifdef USE_VOLK
+      // Work on interleaved floats, weights are real
+      float * third = (float *) d_tf_third;
+      float * two_thirds = (float *) d_tf_two_thirds;
+      float * tmp = (float *) d_tf_tmp;
+
+      volk_32f_s32f_multiply_32f_a(third, (const float *) &g[0], 2.0f / 3.0f, 2 * n);
+      volk_32f_s32f_multiply_32f_a(two_thirds, (const float *) &g[0], 1.0f / 3.0f, 2 * n);
+      volk_32f_s32f_multiply_32f_u(tmp, (const float *) &g[1], 1.0f / 3.0f, 2 * n);
+      volk_32f_x2_add_32f_a(third, third, tmp, 2 * n);
+      volk_32f_x2_add_32f_a(tmp, tmp, tmp, 2 * n);
+      volk_32f_x2_add_32f_a(two_thirds, two_thirds, tmp, 2 * n);
 #else
-    /*************************************************************/
-    // This waits for 4 symbols to have a valid spilot measurement
-    // in each fourth carrier (uses history)
-    // Suppose we have g[k] and g[k+3] then
-    // g[k+1]=(2/3)v[k]+(1/3)v[k+3]
-    // g[k+2]=(1/3)v[k]+(2/3)v[k+3]
-    /*************************************************************/
-
-    d_spilot_index = 0;
+      for (int i = 0; i < n; i++)
+      {
+        d_tf_third[i] = (2.0f * g[i] + g[i + 1]) * d_interp_recip[3];
+        d_tf_two_thirds[i] = (g[i] + 2.0f * g[i + 1]) * d_interp_recip[3];
+      }
+#endif
 
-    for (int k = 0; k < (d_Kmax - d_Kmin + 1); k++)
-    {
-      if (k == get_current_spilot(d_mod_symbol_index))
+      for (int i = 0; i < n; i++)
       {
-        set_channel_gain(k, in[k + d_zeros_on_left]);
-        advance_spilot(d_mod_symbol_index);
+        d_channel_gain[3 * i] = g[i];
+        d_channel_gain[3 * i + 1] = d_tf_third[i];
+        d_channel_gain[3 * i + 2] = d_tf_two_thirds[i];
       }
+
+      d_channel_gain[3 * n] = g[n];
     }
 
-    // Wait for at least 4 symbols to have an estimation on each third carrier
-    if (d_symbol_index < 4)
-      return 1;
-    
-    // Suppose we have a pilot each third carrier.
-    for (int i = 0; i < (d_Kmax - d_Kmin + 1 - 3); i += 3)
+    /*
+     * Correlate received scattered pilots with the ones of a phase.
+     * Products of adjacent pilots (12 carriers apart) cancel most of
+     * the channel phase, they are summed coherently with the sign
+     * of the known pilot products.
+     * coherence is |sum| / energy of pilots, 1 for a perfect match.
+     */
+    float
+    pilot_gen::spilot_correlation(const gr_complex * in, int phase, float * coherence)
     {
-      d_channel_gain[i + 1] = 
-        (gr_complex(2.0, 0.0) * d_channel_gain[i] + d_channel_gain[i + 3]) / gr_complex(3.0, 0.0);
-      d_channel_gain[i + 2] = 
-        (d_channel_gain[i] + gr_complex(2.0, 0.0) * d_channel_gain[i + 3]) / gr_complex(3.0, 0.0);
-    }
+      const int n = d_spilot_map_size[phase];
+      const int * map = d_spilot_map[phase];
+      gr_complex c, e;
+
+      for (int i = 0; i < n; i++)
+        d_spilot_rx[i] = in[d_zeros_on_left + map[i]];
+
+#ifdef USE_VOLK
+      volk_32fc_x2_multiply_conjugate_32fc_u(d_spilot_prod, &d_spilot_rx[1], &d_spilot_rx[0], n - 1);
+      volk_32fc_32f_dot_prod_32fc_u(&c, d_spilot_prod, d_spilot_sign[phase], n - 1);
+      volk_32fc_x2_conjugate_dot_prod_32fc_a(&e, d_spilot_rx, d_spilot_rx, n);
+#else
+      c = gr_complex(0.0, 0.0); e = gr_complex(0.0, 0.0);
 
-    // Signal that equalizer is ready
-    d_equalizer_ready = 1;
+      for (int i = 0; i < (n - 1); i++)
+        c += d_spilot_sign[phase][i] * d_spilot_rx[i + 1] * std::conj(d_spilot_rx[i]);
+
+      for (int i = 0; i < n; i++)
+        e += norm(d_spilot_rx[i]);
 #endif
 
-      int diff_sindex = (d_mod_symbol_index - d_prev_mod_symbol_index + 4) % 4;
+      float sum = std::abs(c);
 
-      d_prev_mod_symbol_index = d_mod_symbol_index;
+      *coherence = (e.real() > 0) ? (sum / e.real()) : 0;
 
-      return diff_sindex;
+      return sum;
     }
 
-    /*
-     * Init continual pilot generator
-     */
-    int 
-    pilot_gen::get_current_cpilot() const
+    int
+    pilot_gen::process_spilot_data(const gr_complex * in)
     {
-      return d_cpilot_carriers[d_cpilot_index];
+      // This is channel estimator
+      // Interpolate the gain between carriers to obtain
+      // gain for non pilot carriers - we use linear interpolation
+            
+      /*************************************************************/
+      // Find out the OFDM symbol index (value 0 to 3) sent
+      // in current block by correlating scattered symbols with
+      // current block - result is (symbol index % 4)
+      /*************************************************************/
+      int found = 0;
+      float coherence;
+
+      // When the symbol index is known only check the predicted phase
+      if (d_symbol_index_known)
+      {
+        int phase = ((d_symbol_index + 1) % d_symbols_per_frame) % 4;
+
+        spilot_correlation(in, phase, &coherence);
+
+        if (coherence > d_spilot_min_coherence)
+        {
+          d_mod_symbol_index = phase;
+          found = 1;
+        }
+      }
+
+      if (!found)
+      {
+        float max = 0; float sum = 0;
+
+        for (int scount = 0; scount < 4; scount++)
+        {
+          sum = spilot_correlation(in, scount, &coherence);
+
+          //printf("sum: %f, max: %f, scount: %i\n", sum, max, scount);
+          if (sum > max)
+          {
+            max = sum;
+            d_mod_symbol_index = scount;
+          }
+        }
+      }
+
+    int diff_sindex = (d_mod_symbol_index - d_prev_mod_symbol_index + 4) % 4;
+
+      // Keep the pilots of this symbol for the channel estimator
+      update_tf_grid(in, diff_sindex);
+
+      d_prev_mod_symbol_index = d_mod_symbol_index;
+
+      return diff_sindex;
     }
 
     gr_complex
@@ -703,10 +1122,25 @@ namespace gr {
       return gr_complex((float)(4 * 2 * (0.5 - d_wk[cpilot])) / 3, 0);
     }
 
-    void
-    pilot_gen::advance_cpilot()
+    /*
+     * Continual pilots have the same value on all symbols, so the product
+     * of a carrier with the same carrier of the next symbol has the same
+     * phase (common phase change) on all continual pilots and a random
+     * phase on data carriers. The correlation is the coherent sum
+     * of these products on continual pilots positions.
+     */
+    float
+    pilot_gen::cpilot_correlation(const gr_complex * in, int start)
     {
-      d_cpilot_index = (++d_cpilot_index) % d_cpilot_carriers_size;
+      gr_complex sum = gr_complex(0.0, 0.0);
+
+      for (int j = 0; j < d_cpilot_carriers_size; j++)
+      {
+        int k = start + d_cpilot_carriers[j];
+        sum += in[k] * std::conj(in[k + d_fft_length]);
+      }
+
+      return norm(sum);
     }
 
     void
@@ -714,19 +1148,37 @@ namespace gr {
     {
       // Look for maximum correlation for cpilots
       // in order to obtain postFFT integer frequency correction
-      
+      // This is done only in acquisition
+
+      // Products between current and next symbol for all carriers
+      // that may hold a continual pilot for any of the offsets
+      const gr_complex * first = &in[d_zeros_on_left - d_freq_offset_max];
+
+#ifdef USE_VOLK
+      volk_32fc_x2_multiply_conjugate_32fc_u(d_cpilot_diff, first, first + d_fft_length, d_cpilot_diff_size);
+#else
+      for (int i = 0; i < d_cpilot_diff_size; i++)
+        d_cpilot_diff[i] = first[i] * std::conj(first[i + d_fft_length]);
+#endif
+
+      // Comb sum over continual pilots positions for all offsets at once
+      for (int i = 0; i < 2 * d_freq_offset_max; i++)
+        d_cpilot_comb[i] = gr_complex(0.0, 0.0);
+
+      for (int j = 0; j < d_cpilot_carriers_size; j++)
+      {
+        const gr_complex * d = &d_cpilot_diff[d_cpilot_carriers[j]];
+
+        for (int i = 0; i < 2 * d_freq_offset_max; i++)
+          d_cpilot_comb[i] += d[i];
+      }
+
       float max = 0; float sum = 0;
       int start = 0;
-      float phase;
 
-      for (int i = d_zeros_on_left - d_freq_offset_max; i < d_zeros_on_left + d_freq_offset_max; i++)
+      for (int i = 0; i < 2 * d_freq_offset_max; i++)
       {
-        sum = 0;
-        for (int j = 0; j < (d_cpilot_carriers_size - 1); j++)
-        {
-          phase = norm(in[i + d_cpilot_carriers[j + 1]] - in[i + d_cpilot_carriers[j]]);
-          sum += d_known_phase_diff[j] * phase;
-        }
+        sum = norm(d_cpilot_comb[i]);
 
         if (sum > max)
         {
@@ -735,25 +1187,53 @@ namespace gr {
         }
       }
 
-      d_freq_offset = start - d_zeros_on_left;
+      int freq_offset = start - d_freq_offset_max;
+
+      // Go in tracking when the same offset is found on consecutive symbols
+      if (freq_offset == d_freq_offset)
+        d_freq_lock_count++;
+      else
+        d_freq_lock_count = 0;
+
+      d_freq_offset = freq_offset;
 
       if (d_freq_offset)
         printf("d_freq_offset: %i\n", d_freq_offset);
     }
 
+    void
+    pilot_gen::check_cpilot_data(const gr_complex * in)
+    {
+      // In tracking verify only the neighbours of the locked offset
+      // and go back in acquisition if one of them is better
+      // for a number of consecutive symbols
+      int start = d_zeros_on_left + d_freq_offset;
+      float locked = cpilot_correlation(in, start);
+
+      if ((cpilot_correlation(in, start - 1) > locked) || (cpilot_correlation(in, start + 1) > locked))
+        d_freq_lock_count++;
+      else
+        d_freq_lock_count = 0;
+
+      if (d_freq_lock_count >= d_freq_unlock_symbols)
+      {
+        printf("Lost frequency lock, d_freq_offset: %i\n", d_freq_offset);
+        reset_frequency_tracking();
+      }
+    }
+
     void
     pilot_gen::compute_oneshot_csft(const gr_complex * in)
     {
       gr_complex left_corr_sum = 0.0; gr_complex right_corr_sum = 0.0;
-      int half_size = (d_cpilot_carriers_size - 1) / 2;
+      int half_size = d_cpilot_carriers_size / 2;
 
-      // TODO init this in constructor
-      float carrier_coeff = 1.0 / (2 * M_PI * (1 + float (d_cp_length) / float (d_fft_length)) * 2);
-      float sampling_coeff = 1.0 / (2 * M_PI * ((1 + float (d_cp_length) / float (d_fft_length)) * ((float)d_cpilot_carriers_size / 2.0)));
+      float carrier_coeff = 1.0 / (2 * M_PI * d_symbol_ratio * 2);
+      float sampling_coeff = 1.0 / (2 * M_PI * d_symbol_ratio * (d_cpilot_right_pos - d_cpilot_left_pos));
 
       float left_angle, right_angle;
 
-      // Compute cpilots correlation between previous symbol and current symbol
+      // Compute cpilots correlation between current symbol and next symbol
       // in both halves of the cpilots. The cpilots are distributed evenly
       // on left and right sides of the center frequency.
 
@@ -763,7 +1243,7 @@ namespace gr {
                          std::conj(in[d_freq_offset + d_fft_length + d_zeros_on_left + d_cpilot_carriers[j]]);
       }
 
-      for (int j = half_size + 1; j < d_cpilot_carriers_size; j++)
+      for (int j = half_size; j < d_cpilot_carriers_size; j++)
       {
         right_corr_sum += in[d_freq_offset + d_zeros_on_left + d_cpilot_carriers[j]] * \
                           std::conj(in[d_freq_offset + d_fft_length + d_zeros_on_left + d_cpilot_carriers[j]]);
@@ -786,63 +1266,229 @@ namespace gr {
       printf("d_sampling_freq_correction: %.10f\n", d_sampling_freq_correction);
 #endif
     }
-    
-    gr_complex *
-    pilot_gen::frequency_correction(const gr_complex * in, gr_complex * out)
+
+    /*
+     * Guard interval changed in config (received with TPS).
+     * Symbol period changes and the frequency loop units with it.
+     */
+    void
+    pilot_gen::update_guard_interval()
     {
-      // TODO - use PI control loop to calculate tracking corrections
-      int symbol_count = 1;
-      
-      for (int k = 0; k < d_fft_length; k++)
+      d_cp_length = config.d_cp_length;
+      d_symbol_ratio = 1.0 + (float)d_cp_length / (float)d_fft_length;
+    }
+
+    void
+    pilot_gen::reset_frequency_tracking()
+    {
+      d_freq_tracking = 0;
+      d_freq_lock_count = 0;
+      d_carrier_phase = 0; d_carrier_freq = 0;
+      d_sampling_phase = 0; d_sampling_freq = 0;
+      d_prev_cpilots_valid = 0;
+    }
+
+    /*
+     * Carrier and sampling frequency tracking
+     * Phase detector is the change of continual pilots phase between
+     * previous and current corrected symbols, on both halves of the spectrum.
+     * Common part is the carrier frequency error, the difference between
+     * halves is the sampling frequency error.
+     * Both go through a PI loop whose output is the phase (and phase slope)
+     * used by frequency_correction() on the next symbol.
+     */
+    void
+    pilot_gen::track_frequency(const gr_complex * in)
+    {
+      gr_complex left_corr_sum = 0.0; gr_complex right_corr_sum = 0.0;
+      int half_size = d_cpilot_carriers_size / 2;
+
+      for (int j = 0; j < d_cpilot_carriers_size; j++)
       {
-        // TODO - for 2k mode the continuous pilots are not split evenly
-        // between left/right center frequency. Probably the scaterred
-        // pilots needs to be added.
-#if 0
-        float correction = (float)d_freq_offset + d_carrier_freq_correction + \
-          d_sampling_freq_correction * (k - (d_fft_length / 2));
-#else
+        gr_complex c = in[d_zeros_on_left + d_cpilot_carriers[j]];
 
-        float correction = (float)d_freq_offset + d_carrier_freq_correction;
-#endif
+        if (j < half_size)
+          left_corr_sum += c * std::conj(d_prev_cpilots[j]);
+        else
+          right_corr_sum += c * std::conj(d_prev_cpilots[j]);
 
-        gr_complex c = gr_expj(-2 * M_PI * correction * \
-          (d_fft_length + d_cp_length) / d_fft_length * symbol_count);
+        d_prev_cpilots[j] = c;
+      }
 
-        // TODO - vectorize this operation
-        out[k] = c * in[k + d_freq_offset];
+      if (!d_prev_cpilots_valid)
+      {
+        d_prev_cpilots_valid = 1;
+        return;
       }
 
-      return (out);
+      float left_angle = std::arg(left_corr_sum);
+      float right_angle = std::arg(right_corr_sum);
+
+      // Phase errors per symbol
+      float carrier_err = (right_angle + left_angle) / 2;
+      float sampling_err = (right_angle - left_angle) / (d_cpilot_right_pos - d_cpilot_left_pos);
+
+      d_carrier_freq += d_pi_ki * carrier_err;
+      d_carrier_phase += d_pi_kp * carrier_err;
+
+      d_sampling_freq += d_pi_ki * sampling_err;
+      d_sampling_phase += d_pi_kp * sampling_err;
+
+      // Keep frequency errors in subcarrier spacing units
+      d_carrier_freq_correction = d_carrier_freq / (2 * M_PI * d_symbol_ratio);
+      d_sampling_freq_correction = d_sampling_freq / (2 * M_PI * d_symbol_ratio);
+    }
+    
+    /*
+     * A phase slope step of sampling_freq (rad/carrier/symbol) is
+     * a symbol start moving with sampling_freq * N / (2 * pi) samples
+     * per symbol. Once handed over the timing is corrected before FFT
+     * and the loop only tracks what is left.
+     */
+    int
+    pilot_gen::get_timing_drift(float * drift)
+    {
+      if (!d_freq_tracking || (d_symbol_index != (d_symbols_per_frame - 1)))
+        return 0;
+
+      *drift = -d_sampling_freq * d_fft_length / (2 * M_PI);
+
+      d_sampling_freq = 0;
+      d_sampling_freq_correction = 0;
+
+      return 1;
     }
 
     /*
-     * Init tps sequence, return values for first position
-     * If first symbol then init tps DBPSK data
+     * A common phase step of carrier_freq (rad/symbol) is a carrier
+     * offset of carrier_freq / (2 * pi * symbol_ratio) subcarrier spacings.
+     * Once handed over the carrier is corrected before FFT and the loop
+     * only tracks what is left.
      */
     int
-    pilot_gen::get_current_tpilot() const
+    pilot_gen::get_carrier_offset(float * offset)
     {
-        return d_tps_carriers[d_tpilot_index];
+      if (!d_freq_tracking || (d_symbol_index != (d_symbols_per_frame - 1)))
+        return 0;
+
+      *offset = d_carrier_freq / (2 * M_PI * d_symbol_ratio);
+
+      d_carrier_freq = 0;
+      d_carrier_freq_correction = 0;
+
+      return 1;
     }
 
-    gr_complex
-    pilot_gen::get_tpilot_value(int tpilot)
+    gr_complex *
+    pilot_gen::frequency_correction(const gr_complex * in, gr_complex * out)
     {
-      //TODO - it can be calculated at the beginnning
-      if (d_symbol_index == 0)
-        d_tps_carriers_val[d_tpilot_index] = gr_complex(2 * (0.5 - d_wk[tpilot]), 0);
-      else
-        if (d_tps_data[d_symbol_index] == 1)
-            d_tps_carriers_val[d_tpilot_index] = gr_complex(-d_tps_carriers_val[d_tpilot_index].real(), 0);
+      // Advance the phase with the frequency obtained from the loop
+      d_carrier_phase = std::fmod(d_carrier_phase + d_carrier_freq, (float)(2 * M_PI));
+      d_sampling_phase += d_sampling_freq;
+
+      // Correction for carrier k is exp(-j * (carrier_phase + sampling_phase * (k - N/2)))
+      // This is a phasor ramp: start value and a constant step between carriers
+      gr_complex phase = gr_expj(-(d_carrier_phase - d_sampling_phase * (d_fft_length / 2)));
+      const gr_complex phase_inc = gr_expj(-d_sampling_phase);
+
+#ifdef USE_VOLK
+      volk_32fc_s32fc_x2_rotator_32fc(out, &in[d_freq_offset], phase_inc, &phase, d_fft_length);
+#else
+      for (int k = 0; k < d_fft_length; k++)
+      {
+        out[k] = phase * in[k + d_freq_offset];
+        phase *= phase_inc;
 
-      return d_tps_carriers_val[d_tpilot_index];
+        // Keep the phasor on the unit circle
+        if ((k & 511) == 511)
+          phase /= std::abs(phase);
+      }
+#endif
+
+      return (out);
     }
 
+    /*
+     * TX symbols differ only by the scattered pilot phase and the
+     * DBPSK sign of TPS pilots: all TPS carriers start with 2 * (1/2 - wk)
+     * on first symbol of a frame and change sign together when the TPS
+     * bit is 1. So there are 8 templates and a TPS sign for each symbol
+     * of a superframe (TPS data depends on frame index only).
+     * Only TX uses them, so they are built (and allocated) on the first
+     * TX symbol and built again if transmission parameters change.
+     */
     void
-    pilot_gen::advance_tpilot()
+    pilot_gen::build_tx_templates()
     {
-      d_tpilot_index = (++d_tpilot_index) % (d_tps_carriers_size);
+      if (d_tx_template[0] == NULL)
+      {
+        if (posix_memalign((void **)&d_tx_template[0], volk_get_alignment(), sizeof(gr_complex) * 8 * d_fft_length))
+        {
+          std::cout << "cannot allocate memory: d_tx_template" << std::endl;
+          return;
+        }
+
+        for (int i = 1; i < 8; i++)
+          d_tx_template[i] = d_tx_template[0] + i * d_fft_length;
+
+        d_tx_tps_sign = new unsigned char[d_frames_per_superframe * d_symbols_per_frame];
+        if (d_tx_tps_sign == NULL)
+        {
+          std::cout << "error allocating d_tx_tps_sign" << std::endl;
+          return;
+        }
+      }
+
+      const int frame_index = d_frame_index;
+
+      for (int f = 0; f < d_frames_per_superframe; f++)
+      {
+        d_frame_index = f;
+        format_tps_data();
+
+        int sign = 0;
+
+        for (int s = 0; s < d_symbols_per_frame; s++)
+        {
+          if ((s != 0) && (d_tps_data[s] == 1))
+            sign ^= 1;
+
+          d_tx_tps_sign[f * d_symbols_per_frame + s] = sign;
+        }
+      }
+
+      d_frame_index = frame_index;
+      format_tps_data();
+
+      for (int phase = 0; phase < 4; phase++)
+      {
+        for (int sign = 0; sign < 2; sign++)
+        {
+          gr_complex * t = d_tx_template[phase * 2 + sign];
+
+          for (int i = 0; i < d_fft_length; i++)
+            t[i] = gr_complex(0.0, 0.0);
+
+          for (int i = 0; i < d_spilot_map_size[phase]; i++)
+          {
+            int k = d_spilot_map[phase][i];
+            t[d_zeros_on_left + k] = get_spilot_value(k);
+          }
+
+          for (int i = 0; i < d_cpilot_carriers_size; i++)
+          {
+            int k = d_cpilot_carriers[i];
+            t[d_zeros_on_left + k] = get_cpilot_value(k);
+          }
+
+          for (int i = 0; i < d_tps_carriers_size; i++)
+          {
+            int k = d_tps_carriers[i];
+            float val = 2 * (0.5 - d_wk[k]);
+            t[d_zeros_on_left + k] = gr_complex(sign ? -val : val, 0);
+          }
+        }
+      }
     }
 
     /*
@@ -858,6 +1504,37 @@ namespace gr {
         }
     }
 
+    /*
+     * Get bits of last TPS data received correctly
+     * (same bit order as in set_tps_bits)
+     */
+    unsigned int
+    pilot_gen::get_tps_bits(int start, int stop)
+    {
+      unsigned int data = 0;
+
+      for (int i = stop; i <= start; i++)
+        data = (data << 1) | ((d_tps_word >> i) & 1);
+
+      return data;
+    }
+
+    int
+    pilot_gen::get_transmission_parameters(long * params)
+    {
+      if (!d_tps_word_new)
+        return 0;
+
+      d_tps_word_new = 0;
+
+      // Same packing as in dvbt_config
+      *params = (long)get_tps_bits(26, 25) | ((long)get_tps_bits(29, 27) << 2) \
+        | ((long)get_tps_bits(32, 30) << 5) | ((long)get_tps_bits(35, 33) << 8) \
+        | ((long)get_tps_bits(37, 36) << 11) | ((long)get_tps_bits(39, 38) << 13);
+
+      return 1;
+    }
+
     /*
      * Clause 4.6
      * Format data that will be sent with TPS signals
@@ -925,8 +1602,9 @@ namespace gr {
 
       for (int k = 0; k < d_tps_carriers_size; k++)
       {
-        // Use equalizer to correct data and frequency correction
-        gr_complex val = in[d_zeros_on_left + d_tps_carriers[k]] * d_channel_gain[d_tps_carriers[k]];
+        // Input is frequency corrected, the phase difference
+        // to previous symbol needs no equalization
+        gr_complex val = in[d_tps_carriers[k]];
 
         if (!d_symbol_index_known || (d_symbol_index != 0))
         {
@@ -943,63 +1621,46 @@ namespace gr {
 
       PRINTF("tps_majority_zero: %i\n", tps_majority_zero);
 
-      // Insert obtained TPS bit into FIFO
-      // Insert the same bit into FIFO in the case
-      // diff_symbol_index is more than one. This will happen
-      // in the case of losting 1 to 3 symbols.
-      // This could be corrected by BCH decoder afterwards.
+      // Insert obtained TPS bit into the register
+      // In the case diff_symbol_index is not one (losting 1 to 3 symbols)
+      // the bits of the lost symbols are unknown and the current bit is
+      // the difference to a symbol that is not the previous one.
+      // All these bits are marked invalid and the register stays
+      // aligned with the symbol index.
+      int bit = 0;
 
-      for (int i = 0; i < diff_symbol_index; i++)
-      {
-        // Take out the front entry first
-        d_rcv_tps_data.pop_front();
+      if (!d_symbol_index_known || (d_symbol_index != 0))
+        bit = (tps_majority_zero >= 0) ? 0 : 1;
 
-        // Add data at tail
-        if (!d_symbol_index_known || (d_symbol_index != 0))
-        {
-          if (tps_majority_zero >= 0)
-            d_rcv_tps_data.push_back(0);
-          else
-            d_rcv_tps_data.push_back(1);
-        }
-        else
-          d_rcv_tps_data.push_back(0);
-      }
+      for (int i = 0; i < diff_symbol_index; i++)
+        shift_tps_bit(bit, diff_symbol_index == 1);
 
       // Match synchronization signatures
-      if (std::equal(d_rcv_tps_data.begin() + 1, d_rcv_tps_data.begin() + d_tps_sync_evenv.size(), d_tps_sync_evenv.begin()))
+      // s1-s16 must have been received, up to d_tps_sync_max_errors
+      // of them may be wrong
+      unsigned int sync = (d_rcv_tps_lo >> 1) & 0xffff;
+      unsigned int sync_valid = (d_rcv_tps_valid_lo >> 1) & 0xffff;
+      int even = __builtin_popcount(sync ^ d_tps_sync_even_word) <= d_tps_sync_max_errors;
+      int odd = __builtin_popcount(sync ^ d_tps_sync_odd_word) <= d_tps_sync_max_errors;
+
+      if ((sync_valid == 0xffff) && (even || odd))
       {
-        // Verify parity for TPS data
-        if (!verify_bch_code(d_rcv_tps_data))
-        {
-          d_frame_index = (d_rcv_tps_data[23] << 1) | (d_rcv_tps_data[24]);
-          printf("Aquired sync - TPS OK for frame: %i\n", d_frame_index);
-
-          d_symbol_index_known = 1;
-          end_frame = 1;
-        }
-        else
-        {
-          printf("Lost sync - TPS Not OK for frame 0 or 2\n");
+        // The sync word is known, put it back in place of the received
+        // one so the BCH code (computed over s1-s53) checks the TPS data
+        unsigned int word = even ? d_tps_sync_even_word : d_tps_sync_odd_word;
+        d_rcv_tps_lo = (d_rcv_tps_lo & ~((uint64_t)0xffff << 1)) | ((uint64_t)word << 1);
 
-          d_symbol_index_known = 0;
-          end_frame = 0;
-        }
+        // All bits s1-s67 must be valid
+        int valid = (((d_rcv_tps_valid_lo >> 1) == (((uint64_t)1 << 63) - 1)) && \
+            (d_rcv_tps_valid_hi == 0xf));
 
-        //for (int i = 0; i < d_symbols_per_frame; i++)
-          //printf("%i", d_rcv_tps_data[i]);
-        //printf("\n");
-
-        // Clear up FIFO
-        for (int i = 0; i < d_symbols_per_frame; i++)
-          d_rcv_tps_data[i] = 0;
-      }
-      else if (std::equal(d_rcv_tps_data.begin() + 1, d_rcv_tps_data.begin() + d_tps_sync_oddv.size(), d_tps_sync_oddv.begin()))
-      {
         // Verify parity for TPS data
-        if (!verify_bch_code(d_rcv_tps_data))
+        if (valid && !verify_bch_code())
         {
-          d_frame_index = (d_rcv_tps_data[23] << 1) | (d_rcv_tps_data[24]);
+          d_tps_word = d_rcv_tps_lo;
+          d_tps_word_new = 1;
+
+          d_frame_index = get_tps_bits(24, 23);
           printf("Aquired sync - TPS OK for frame: %i\n", d_frame_index);
 
           d_symbol_index_known = 1;
@@ -1007,20 +1668,19 @@ namespace gr {
         }
         else
         {
-          printf("Lost sync - TPS Not OK for frame 1 or 3\n");
+          if (even)
+            printf("Lost sync - TPS Not OK for frame 0 or 2\n");
+          else
+            printf("Lost sync - TPS Not OK for frame 1 or 3\n");
 
           d_symbol_index_known = 0;
           end_frame = 0;
         }
 
-        //for (int i = 0; i < d_symbols_per_frame; i++)
-          //printf("%i", d_rcv_tps_data[i]);
-        //printf("\n");
-
-        // Clear up FIFO
-        for (int i = 0; i < d_symbols_per_frame; i++)
-          d_rcv_tps_data[i] = 0;
-      }     
+        // Clear up register
+        d_rcv_tps_lo = 0; d_rcv_tps_hi = 0;
+        d_rcv_tps_valid_lo = 0; d_rcv_tps_valid_hi = 0;
+      }
 
       PRINTF("d_symbol_index: %i\n", d_symbol_index);
       PRINTF("next_symbol_index: %i\n", next_symbol_index);
@@ -1029,85 +1689,18 @@ namespace gr {
     }
 
     void
-    pilot_gen::set_chanestim_carrier(int k)
-    {
-      d_chanestim_carriers[d_chanestim_index] = k;
-    }
-
-    void
-    pilot_gen::advance_chanestim()
-    {
-      d_chanestim_index++;
-    }
-
-    int
-    pilot_gen::get_current_payload()
-    {
-      return d_payload_carriers[d_payload_index];
-    }
-
-    void
-    pilot_gen::set_payload_carrier(int k)
-    {
-      d_payload_carriers[d_payload_index] = k;
-    }
-
-    void
-    pilot_gen::advance_payload()
+    pilot_gen::process_payload_data(const gr_complex *in, gr_complex *out, int mod_symbol_index)
     {
-      d_payload_index++;
-    }
-
-    void
-    pilot_gen::process_payload_data(const gr_complex *in, gr_complex *out)
-    {
-      //reset indexes
-      d_spilot_index = 0; d_cpilot_index = 0; d_tpilot_index = 0;
-      d_payload_index = 0;d_chanestim_index = 0;
-      int is_payload = 1;
-
-      //process one block - one symbol
-      for (int k = 0; k < (d_Kmax - d_Kmin + 1); k++)
-      {
-        is_payload = 1;
-
-        // Keep data for channel estimation
-        // This depends on the symbol index
-        if (k == get_current_spilot(d_mod_symbol_index))
-        {
-          advance_spilot(d_mod_symbol_index); 
-          is_payload = 0;
-        }
-
-        // Keep data for frequency correction
-        // and channel estimation
-        if (k == get_current_cpilot())
-        {
-          advance_cpilot();
-          is_payload = 0;
-        }
-        
-        if (k == get_current_tpilot())
-        {
-          advance_tpilot();
-          is_payload = 0;
-        } 
-
-        // Keep payload carrier number
-        // This depends on the symbol index
-        if (is_payload)
-        {
-          set_payload_carrier(k);
-          advance_payload();
-        }
-      }
-
       if (d_equalizer_ready)
       {
-        // Equalize payload data according to channel estimator
+        // Payload carriers depend on the symbol index
+        d_payload_carriers = d_payload_map[mod_symbol_index];
+        d_payload_index = d_payload_map_size[mod_symbol_index];
+
+        // Input is already equalized, just gather payload carriers
         for (int i = 0; i < d_payload_index; i++)
         {
-          out[i] = in[d_zeros_on_left + d_payload_carriers[i]] * d_channel_gain[d_payload_carriers[i]];
+          out[i] = in[d_payload_carriers[i]];
         }
       }
       else
@@ -1115,56 +1708,27 @@ namespace gr {
         // If equ not ready, return 0
         for (int i = 0; i < d_payload_length; i++)
         {
-          out[0] = gr_complex(0.0, 0.0);
+          out[i] = gr_complex(0.0, 0.0);
         }
       }
     }
 
-    void
-    pilot_gen::update_output(const gr_complex *in, gr_complex *out)
+    int
+    pilot_gen::start_tx_symbol(gr_complex *out)
     {
-      int is_payload = 1;
-      int payload_count = 0;
+      const int symbol_index = d_symbol_index;
+      const long params = config.get_transmission_parameters();
 
-      //move to the next symbol
-      //re-genereate TPS data
-      format_tps_data();
-
-      //reset indexes
-      payload_count = 0;
-      d_spilot_index = 0; d_cpilot_index = 0; d_tpilot_index = 0;
-
-      for (int i = 0; i < d_zeros_on_left; i++)
-        out[i] = gr_complex(0.0, 0.0);
-
-      //process one block - one symbol
-      for (int k = d_Kmin; k < (d_Kmax - d_Kmin + 1); k++)
+      if (params != d_tx_params)
       {
-          is_payload = 1;
-          if (k == get_current_spilot(d_symbol_index))
-          {
-            out[d_zeros_on_left + k] = get_spilot_value(k);
-            advance_spilot(d_symbol_index);
-            is_payload = 0;
-          }
-
-          if (k == get_current_cpilot())
-          {
-            out[d_zeros_on_left + k] = get_cpilot_value(k);
-            advance_cpilot();
-            is_payload = 0;
-          }
+        build_tx_templates();
+        d_tx_params = params;
+      }
 
-          if (k == get_current_tpilot())
-          {
-            out[d_zeros_on_left + k] = get_tpilot_value(k);
-            advance_tpilot();
-            is_payload = 0;
-          } 
+      const int phase = d_symbol_index % 4;
+      const int sign = d_tx_tps_sign[d_frame_index * d_symbols_per_frame + d_symbol_index];
 
-          if (is_payload == 1)
-            out[d_zeros_on_left + k] = in[payload_count++];
-      }
+      memcpy(out, d_tx_template[phase * 2 + sign], sizeof(gr_complex) * d_fft_length);
 
       // update indexes
       if (++d_symbol_index == d_symbols_per_frame)
@@ -1177,9 +1741,27 @@ namespace gr {
         }
       }
 
-      for (int i = (d_fft_length - d_zeros_on_right); i < d_fft_length; i++)
-        out[i] = gr_complex(0.0, 0.0);
+      return symbol_index;
+    }
+
+    const int *
+    pilot_gen::get_payload_carriers(int symbol_index)
+    {
+      return d_payload_map[symbol_index % 4];
+    }
+
+    /*
+     * TX symbol is a copy of its template with
+     * payload scattered on the payload carriers.
+     */
+    void
+    pilot_gen::update_output(const gr_complex *in, gr_complex *out)
+    {
+      const int * payload = get_payload_carriers(start_tx_symbol(out));
+      gr_complex * carriers = &out[d_zeros_on_left];
 
+      for (int i = 0; i < d_payload_length; i++)
+        carriers[payload[i]] = in[i];
     }
 
     int
@@ -1195,27 +1777,50 @@ namespace gr {
       // to advance the symbol index inside a frame (0 to 67)
       // Then based on the TPS data we find out the start of a frame
 
-      // Process cpilot data
-      // This is postFFT integer frequency offset estimation
-      // This is called before all other processing
-      process_cpilot_data(in);
+      if (!d_freq_tracking)
+      {
+        // Process cpilot data
+        // This is postFFT integer frequency offset estimation
+        // This is called before all other processing
+        process_cpilot_data(in);
+
+        // Compute one shot Post-FFT Carrier and Sampling Frequency Tracking
+        // Obtain fractional Carrer and Sampling frequency corrections
+        // Before this moment it is assumed to have corrected this:
+        // - symbol timing (pre-FFT)
+        // - symbol frequency correction (pre-FFT)
+        // - integer frequency correction (post-FFT)
+        compute_oneshot_csft(in);
+
+        // Until lock the correction follows the one shot estimation
+        d_carrier_freq = -2 * M_PI * d_symbol_ratio * d_carrier_freq_correction;
+        d_sampling_freq = -2 * M_PI * d_symbol_ratio * d_sampling_freq_correction;
+
+        if (d_freq_lock_count >= d_freq_lock_symbols)
+        {
+          printf("Frequency lock, d_freq_offset: %i\n", d_freq_offset);
 
-      // Compute one shot Post-FFT Carrier and Sampling Frequency Tracking
-      // Obtain fractional Carrer and Sampling frequency corrections
-      // Before this moment it is assumed to have corrected this:
-      // - symbol timing (pre-FFT)
-      // - symbol frequency correction (pre-FFT)
-      // - integer frequency correction (post-FFT)
-      // TODO - call this just in the aquisition mode
-      compute_oneshot_csft(in);
+          d_freq_tracking = 1;
+          d_freq_lock_count = 0;
+          d_prev_cpilots_valid = 0;
+        }
+      }
+      else
+      {
+        // Verify integer frequency offset on neighbours only
+        check_cpilot_data(in);
+      }
 
       // Gather all corrections and obtain a corrected OFDM symbol:
       // - input symbol shift (post-FFT)
       // - integer frequency correction (post-FFT)
       // - fractional frequency (carrier and sampling) corrections (post-FFT)
-      // TODO - use PI to update the corrections
       frequency_correction(in, d_derot_in);
 
+      // Update carrier and sampling frequency PI loop
+      if (d_freq_tracking)
+        track_frequency(d_derot_in);
+
       // Process spilot data
       // This is channel estimation function
       int diff_symbol_index = process_spilot_data(d_derot_in);
@@ -1224,21 +1829,44 @@ namespace gr {
       // use correct symbol index
       d_symbol_index = (d_symbol_index + diff_symbol_index) % d_symbols_per_frame;
 
-      // Symbol index is used in other modules too
-      *symbol_index = d_symbol_index;
-      // Frame index is used in other modules too
-      *frame_index = d_frame_index;
+      // Keep the indexes of this symbol in its ring slot
+      d_tf_symbol_index[d_tf_slot] = d_symbol_index;
+      d_tf_frame_index[d_tf_slot] = d_frame_index;
+      d_tf_mod_index[d_tf_slot] = d_mod_symbol_index;
 
       // Process TPS data
       // If a frame is recognized then signal end of frame
-      int frame_end = process_tps_data(d_derot_in, diff_symbol_index);
+      // TPS is DBPSK, it needs no equalization
+      int frame_end = process_tps_data(&d_derot_in[d_zeros_on_left], diff_symbol_index);
 
       // We are just at the end of a frame
       if (frame_end)
         d_symbol_index = d_symbols_per_frame - 1;
- 
-      // Process payload data with correct symbol index
-      process_payload_data(d_derot_in, out);
+
+      // Equalize the oldest symbol of the ring, its channel gain is
+      // interpolated in time between the scattered pilots around it
+      // (the current symbol is 3 symbols after it)
+      int oldest = (d_tf_slot + 1) % 4;
+
+      // Symbol index is used in other modules too
+      *symbol_index = d_tf_symbol_index[oldest];
+      // Frame index is used in other modules too
+      *frame_index = d_tf_frame_index[oldest];
+
+      d_equalizer_ready = (d_tf_mod_index[oldest] >= 0);
+
+      if (d_equalizer_ready)
+      {
+        estimate_channel(oldest);
+        equalize(d_tf_in[oldest]);
+      }
+
+      // Process payload data of the oldest symbol
+      process_payload_data(d_equalized, out, d_tf_mod_index[oldest]);
+
+      // Oldest slot takes next symbol
+      d_tf_slot = oldest;
+      d_derot_in = d_tf_in[d_tf_slot];
 
       // noutput_items should be 1 in this case
       return 1;
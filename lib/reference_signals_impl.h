@@ -24,7 +24,7 @@
 #include <dvbt/reference_signals.h>
 #include <dvbt/dvbt_config.h>
 #include <vector>
-#include <deque>
+#include <stdint.h>
 
     // This should eventually go into a const file
     const int SYMBOLS_PER_FRAME = 68;
@@ -46,8 +46,13 @@ namespace gr {
      * \param c config object to keep all config data
      */
 
+  class qa_reference_signals;
+
   class pilot_gen {
   private:
+    // Checks TX symbols against the per carrier construction
+    friend class qa_reference_signals;
+
     // this should be first in order to be initialized first
     const dvbt_config &config;
 
@@ -93,6 +98,7 @@ namespace gr {
     static const int d_tps_sync_size;
     static const int d_tps_sync_even[];
     static const int d_tps_sync_odd[];
+    static const int d_tps_sync_max_errors;
 
     // Variables to keep data for 2k, 8k, 4k
     int d_spilot_carriers_size;
@@ -101,19 +107,89 @@ namespace gr {
 
     int d_cpilot_carriers_size;
     const int * d_cpilot_carriers;
-    float * d_known_phase_diff;
-    float * d_cpilot_phase_diff;
+    // Products of carriers between two consecutive symbols
+    // used for integer frequency offset search
+    gr_complex * d_cpilot_diff;
+    int d_cpilot_diff_size;
+    // Comb sums for all searched offsets
+    gr_complex * d_cpilot_comb;
     int d_freq_offset_max;
     int d_freq_offset;
     float d_carrier_freq_correction;
     float d_sampling_freq_correction;
 
-    // Variable to keep corrected OFDM symbol
+    // Frequency tracking state
+    // In acquisition the integer frequency offset is searched on each symbol,
+    // in tracking the carrier and sampling frequency errors go through a PI loop
+    int d_freq_tracking;
+    int d_freq_lock_count;
+    static const int d_freq_lock_symbols;
+    static const int d_freq_unlock_symbols;
+    static const float d_pi_kp;
+    static const float d_pi_ki;
+    // (N + G) / N
+    float d_symbol_ratio;
+    // Mean position of left and right half continual pilots (from center)
+    float d_cpilot_left_pos;
+    float d_cpilot_right_pos;
+    // Loop state: common phase (rad) and phase step (rad/symbol)
+    float d_carrier_phase;
+    float d_carrier_freq;
+    // Loop state: phase slope (rad/carrier) and its step (rad/carrier/symbol)
+    float d_sampling_phase;
+    float d_sampling_freq;
+    // Continual pilots of previous symbol after correction
+    gr_complex * d_prev_cpilots;
+    int d_prev_cpilots_valid;
+
+    // Corrected OFDM symbol (current slot of d_tf_in)
     gr_complex * d_derot_in;
+    // Variable to keep equalized OFDM symbol (useful carriers only)
+    gr_complex * d_equalized;
+    // Reciprocals of distances between channel estimation carriers
+    static const int d_interp_max_step;
+    float * d_interp_recip;
+
+    // Time-frequency channel estimator.
+    // Ring of the last 4 corrected symbols: the oldest one is equalized,
+    // so that each third carrier has a scattered pilot before and after
+    // it (up to 3 symbols away) to interpolate in time.
+    gr_complex * d_tf_in[4];
+    int d_tf_slot;
+    // Symbol index, frame index and scattered pilot phase of each slot
+    // (phase -1 for an empty slot)
+    int d_tf_symbol_index[4];
+    int d_tf_frame_index[4];
+    int d_tf_mod_index[4];
+    // Last and previous (4 symbols before) scattered pilot gain
+    // on each third carrier
+    gr_complex * d_tf_cur;
+    gr_complex * d_tf_old;
+    // Weight of previous gain for each third carrier for each phase of
+    // the equalized symbol (interleaved, same for real and imag)
+    float * d_tf_time_w[4];
+    // Continual pilots of previous symbol
+    gr_complex * d_tf_cpilots;
+    // Number of consecutive symbols with a continuous channel
+    int d_tf_symbols;
+    // Grid interpolated in time, then in frequency
+    gr_complex * d_tf_grid;
+    int d_tf_grid_size;
+    // Buffers for frequency interpolation on the grid
+    gr_complex * d_tf_third;
+    gr_complex * d_tf_two_thirds;
+    gr_complex * d_tf_tmp;
+    // Grid nodes of linear interpolation
+    gr_complex * d_tf_lin;
+    // Cubic interpolation weights for 1/3 of grid step
+    static const float d_tf_weights[4];
+    // Limits of channel change between symbols for time interpolation
+    static const float d_tf_max_step;
+    static const float d_tf_max_phase;
+    static const float d_tf_min_coherence;
 
     int d_tps_carriers_size;
     const int * d_tps_carriers;
-    gr_complex * d_tps_carriers_val;
  
     // Keeps TPS data
     unsigned char * d_tps_data;
@@ -121,18 +197,54 @@ namespace gr {
     gr_complex * d_prev_tps_symbol;
     // Keep TPS carriers values from current symbol
     gr_complex * d_tps_symbol;
-    // Keeps the rcv TPS data, is a FIFO
-    std::deque<char> d_rcv_tps_data;
-    // Keeps the TPS sync sequence
-    std::deque<char> d_tps_sync_evenv;
-    std::deque<char> d_tps_sync_oddv;
+    // Keeps the rcv TPS data, is a 68 bits shift register.
+    // At the end of a frame s0 is on bit 0 and s67 on bit 67.
+    uint64_t d_rcv_tps_lo;
+    unsigned int d_rcv_tps_hi;
+    // Marks the bits of the register that were received correctly
+    uint64_t d_rcv_tps_valid_lo;
+    unsigned int d_rcv_tps_valid_hi;
+    // Keeps the TPS sync words (s1 on bit 0)
+    unsigned int d_tps_sync_even_word;
+    unsigned int d_tps_sync_odd_word;
+    // Table used for BCH code computation (8 bits at a time)
+    unsigned int d_bch_table[256];
+    // Last TPS data received correctly and not yet read
+    uint64_t d_tps_word;
+    int d_tps_word_new;
 
     // Keeps channel estimation carriers
     // we use both continual and scattered carriers
-    int * d_chanestim_carriers;
+    const int * d_chanestim_carriers;
 
     // Keeps paload carriers
-    int * d_payload_carriers;
+    const int * d_payload_carriers;
+
+    // Carrier maps for each scattered pilot phase (symbol index % 4).
+    // They are built once at start, each symbol only selects one.
+    int * d_spilot_map[4];
+    int d_spilot_map_size[4];
+    int * d_chanestim_map[4];
+    int d_chanestim_map_size[4];
+    int * d_payload_map[4];
+    int d_payload_map_size[4];
+
+    // TX symbol templates with zeros and all pilots, one for each
+    // scattered pilot phase and TPS sign (phase * 2 + sign)
+    gr_complex * d_tx_template[8];
+    // TPS sign (1 if inverted) of each symbol of a superframe
+    unsigned char * d_tx_tps_sign;
+    // Transmission parameters the templates were built for
+    long d_tx_params;
+
+    // Scattered pilot phase detection
+    // Sign of product of known values of adjacent scattered pilots
+    float * d_spilot_sign[4];
+    // Received scattered pilots and products of adjacent ones
+    gr_complex * d_spilot_rx;
+    gr_complex * d_spilot_prod;
+    // Min coherence to accept the predicted phase when locked
+    static const float d_spilot_min_coherence;
 
     // Indexes for all carriers
     int d_spilot_index;
@@ -155,6 +267,7 @@ namespace gr {
 
     // TPS private methods
     void set_tps_bits(int start, int stop, unsigned int data);
+    unsigned int get_tps_bits(int start, int stop);
      
     void set_symbol_index(int index);
     int get_symbol_index();
@@ -163,52 +276,52 @@ namespace gr {
 
     void reset_pilot_generator();
 
+    // Build carrier maps for all scattered pilot phases
+    void build_carrier_maps();
+
     // Scattered pilot generator methods
-    int get_current_spilot(int spilot) const;
     gr_complex get_spilot_value(int spilot);
     void set_spilot_value(int spilot, gr_complex val);
-    void advance_spilot(int sindex);
-    // Methods used to quick iterate through all spilots
-    int get_first_spilot();
-    int get_last_spilot() const;
-    int get_next_spilot();
     // Scattered pilot data processing method
+    float spilot_correlation(const gr_complex * in, int phase, float * coherence);
     int process_spilot_data(const gr_complex * in);
 
     // Channel estimation methods
     void set_channel_gain(int spilot, gr_complex val);
+    void equalize(const gr_complex * in);
+    void update_tf_grid(const gr_complex * in, int diff_symbol_index);
+    void estimate_channel(int slot);
+    void interpolate_tf_grid();
+    void interpolate_linear();
 
     // Continual pilot generator methods
-    int get_current_cpilot() const;
     gr_complex get_cpilot_value(int cpilot);
-    void advance_cpilot();
     // Continual pilot data processing methods
+    float cpilot_correlation(const gr_complex * in, int start);
     void process_cpilot_data(const gr_complex * in);
+    void check_cpilot_data(const gr_complex * in);
     void compute_oneshot_csft(const gr_complex * in);
+    void reset_frequency_tracking();
+    void track_frequency(const gr_complex * in);
     gr_complex * frequency_correction(const gr_complex * in, gr_complex * out);
 
-    // TPS generator methods
-    int get_current_tpilot() const;
-    gr_complex get_tpilot_value(int tpilot);
-    void advance_tpilot();
+    // Build TX symbol templates and TPS signs
+    void build_tx_templates();
     // TPS data
     void format_tps_data();
     // Encode TPS data
+    void init_bch_table();
+    unsigned int bch_parity(uint64_t data);
     void generate_bch_code();
     // Verify parity on TPS data
-    int verify_bch_code(std::deque<char> data);
+    int verify_bch_code();
+    // Shift a TPS bit in the rcv TPS register
+    void shift_tps_bit(int bit, int valid);
     // TPS data processing metods
     int process_tps_data(const gr_complex * in, const int diff_symbo_index);
 
-    // Channel estimation methods
-    void set_chanestim_carrier(int k);
-
     // Payload data processing methods
-    int get_current_payload();
-    void advance_chanestim();
-    void set_payload_carrier(int k);
-    void advance_payload();
-    void process_payload_data(const gr_complex *in, gr_complex *out);
+    void process_payload_data(const gr_complex *in, gr_complex *out, int mod_symbol_index);
 
     int d_trigger_index;
 
@@ -223,14 +336,59 @@ namespace gr {
      */
     void update_output(const gr_complex *in, gr_complex *out);
 
+    /*!
+     * Start a TX symbol: copy its zeros and pilots to out and move
+     * to next symbol. Payload carriers are left for the caller. \n
+     * Returns the symbol index of the symbol started. \n
+     */
+    int start_tx_symbol(gr_complex *out);
+
+    /*!
+     * Payload carriers (from Kmin) of a symbol with symbol index. \n
+     */
+    const int * get_payload_carriers(int symbol_index);
+
     /*!
      * TODO
      * ETSI EN 300 744 Clause 4.5. \n
      * Extract data from a set of carriers using pilot signals. \n
      * This is doing frequency correcton, equalization. \n
+     * Payload on out is the one of the symbol received 3 calls before
+     * (channel is interpolated in time between pilots around it),
+     * symbol_index and frame_index are the ones of that symbol. \n
      */
     int parse_input(const gr_complex *in, gr_complex *out, int * symbol_index, int * frame_index);
 
+    /*!
+     * ETSI EN 300 744 Clause 4.6.2. \n
+     * Get the transmission parameters received with TPS, packed as
+     * in dvbt_config::get_transmission_parameters(). \n
+     * Returns 1 if a new TPS frame was received since last call. \n
+     */
+    int get_transmission_parameters(long * params);
+
+    /*!
+     * Hand over the sampling clock offset to pre-FFT timing. \n
+     * Gives the drift of the symbol start (samples per symbol) learned
+     * by the tracking loop since last call and removes it from the loop. \n
+     * Returns 1 once per frame while tracking. \n
+     */
+    int get_timing_drift(float * drift);
+
+    /*!
+     * Hand over the carrier frequency offset to pre-FFT derotation. \n
+     * Gives the carrier offset (subcarrier spacings) learned by the
+     * tracking loop since last call and removes it from the loop. \n
+     * Returns 1 once per frame while tracking. \n
+     */
+    int get_carrier_offset(float * offset);
+
+    /*!
+     * Take the guard interval from config again
+     * (after it was changed with TPS). \n
+     */
+    void update_guard_interval();
+
     };
 
 
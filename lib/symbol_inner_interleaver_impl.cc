@@ -32,68 +32,84 @@ namespace gr {
     const char symbol_inner_interleaver_impl::d_bit_perm_2k[] = {4, 3, 9, 6, 2, 8, 1, 5, 7, 0};
     const char symbol_inner_interleaver_impl::d_bit_perm_8k[] = {7, 1, 4, 2, 9, 6, 8, 10, 0, 3, 11, 5};
 
+    int * symbol_inner_interleaver_impl::d_h_2k = NULL;
+    int * symbol_inner_interleaver_impl::d_h_8k = NULL;
+    gr::thread::mutex symbol_inner_interleaver_impl::d_h_mutex;
+
     void
-    symbol_inner_interleaver_impl::generate_H()
+    symbol_inner_interleaver_impl::generate_H(int * h, dvbt_transmission_mode_t transmission)
     {
-      const int Mmax = d_fft_length;
-      const int Nmax = d_payload_length;
-      const int Nr = int(ceil(log2(d_fft_length)));
-      int q = 0;
-      int hq = 0;
+      const char * bit_perm;
+      int Mmax, Nmax;
 
-      for (int i = 0; i < Mmax; i++)
+      if (transmission == gr::dvbt::T8k)
       {
-        d_h[q] = ((i % 2) << (Nr - 1)) + calculate_R(i);
-        if (d_h[q] < Nmax) q++;
+        bit_perm = d_bit_perm_8k;
+        Mmax = 8192; Nmax = 6048;
+      }
+      else
+      {
+        bit_perm = d_bit_perm_2k;
+        Mmax = 2048; Nmax = 1512;
       }
-    }
-
-    int
-    symbol_inner_interleaver_impl::H(int q)
-    {
-      return d_h[q];
-    }
 
-    int
-    symbol_inner_interleaver_impl::calculate_R(int i)
-    {
-      const int Nr = int(ceil(log2(d_fft_length)));
+      const int Nr = int(ceil(log2(Mmax)));
+      const int mask = (1 << (Nr - 1)) - 1;
+      int q = 0;
+      // R'i register. It is 0 for i = 0, 1 and 1 for i = 2
       int reg = 0;
 
-      if (i == 0)
-        reg = 0;
-      else if (i == 1)
-        reg = 0;
-      else if (reg == 2)
-        reg = 1;
-      else
+      for (int i = 0; i < Mmax; i++)
       {
-        reg = 1;
-        for (int k = 3; k <= i; k++)
+        // Clock the register one step for each i
+        if (i == 2)
+          reg = 1;
+        else if (i > 2)
         {
-          char new_bit = 0;
+          int new_bit = 0;
 
-          if (d_transmission_mode == gr::dvbt::T2k)
-            new_bit = (reg ^ (reg >> 3)) & 1;
-          else if (d_transmission_mode == gr::dvbt::T8k)
+          if (transmission == gr::dvbt::T8k)
             new_bit = (reg ^ (reg >> 1) ^ (reg >> 4) ^ (reg >> 6)) & 1;
           else
             new_bit = (reg ^ (reg >> 3)) & 1;
 
-          int mask = (1 << Nr) - 1;
           reg = ((reg >> 1) | (new_bit << (Nr - 2))) & mask;
         }
+
+        // Ri is R'i with bits permuted
+        int r = 0;
+
+        for (int k = 0; k < (Nr - 1); k++)
+          r |= ((reg >> k) & 1) << bit_perm[k];
+
+        int hq = ((i % 2) << (Nr - 1)) + r;
+
+        if (hq < Nmax)
+          h[q++] = hq;
       }
+    }
 
-      int newreg = 0;
+    const int *
+    symbol_inner_interleaver_impl::H_table(dvbt_transmission_mode_t transmission)
+    {
+      gr::thread::scoped_lock lock(d_h_mutex);
+
+      int ** h = (transmission == gr::dvbt::T8k) ? &d_h_8k : &d_h_2k;
 
-      for (int k = 0; k < (Nr - 1); k++)
+      if (*h == NULL)
       {
-        char bit = (reg >> k) & 1;
-        newreg = newreg | (bit << d_bit_perm[k]); 
+        int * t = new int[(transmission == gr::dvbt::T8k) ? 6048 : 1512];
+        generate_H(t, transmission);
+        *h = t;
       }
 
-      return newreg;
+      return *h;
+    }
+
+    int
+    symbol_inner_interleaver_impl::H(int q)
+    {
+      return d_h[q];
     }
 
     symbol_inner_interleaver::sptr
@@ -115,7 +131,8 @@ namespace gr {
       config(gr::dvbt::QAM16, gr::dvbt::NH, gr::dvbt::C1_2, gr::dvbt::C1_2, gr::dvbt::G1_32, transmission),
       d_nsize(nsize), d_direction(direction),
       d_fft_length(0), d_payload_length(0),
-      d_symbol_index(0)
+      d_symbol_index(0),
+      d_symbol_index_key(pmt::string_to_symbol("symbol_index"))
     {
       d_symbols_per_frame = config.d_symbols_per_frame;
       d_transmission_mode = config.d_transmission_mode;
@@ -126,23 +143,8 @@ namespace gr {
       // Verify if transmission mode matches with size of block
       assert(d_payload_length != d_nsize);
 
-      // Allocate memory for h vector
-      d_h = new int[d_fft_length];
-      if (d_h == NULL)
-      {
-        std::cout << "cannot allocate memory for d_h" << std::endl;
-      }
-
-      // Setup bit permutation vectors
-      if (d_transmission_mode == gr::dvbt::T2k)
-        d_bit_perm = d_bit_perm_2k;
-      else if (d_transmission_mode == gr::dvbt::T8k)
-        d_bit_perm = d_bit_perm_8k;
-      else
-        d_bit_perm = d_bit_perm_2k;
-
-      // Generate the h function
-      generate_H();
+      // Get the h function
+      d_h = H_table(d_transmission_mode);
     }
 
     /*
@@ -150,7 +152,6 @@ namespace gr {
      */
     symbol_inner_interleaver_impl::~symbol_inner_interleaver_impl()
     {
-      delete [] d_h;
     }
 
     void
@@ -168,13 +169,14 @@ namespace gr {
         const unsigned char *in = (unsigned char *) input_items[0];
         unsigned char *out = (unsigned char *) output_items[0];
 
-        // Demod reference signals sends a tag per OFDM frame
-        // containing the symbol index.
-        std::vector<tag_t> tags;
+        // Demod reference signals sends a symbol index tag at the
+        // start of each frame and when the index jumps.
         const uint64_t nread = this->nitems_read(0); //number of items read on port 0
 
-        // Read all tags on the input buffer
-        this->get_tags_in_range(tags, 0, nread, nread + noutput_items, pmt::string_to_symbol("symbol_index"));
+        if (!d_direction)
+          this->get_tags_in_range(d_tags, 0, nread, nread + noutput_items, d_symbol_index_key);
+
+        int t = 0;
 
         for (int k = 0; k < noutput_items; k++)
         {
@@ -196,7 +198,19 @@ namespace gr {
           else
           {
             // Deinterleave
-            d_symbol_index = pmt::to_long(tags[k].value);
+            // Take the symbol index from a tag if there is one on
+            // this item, otherwise it follows the previous one.
+            if ((t < (int)d_tags.size()) && (d_tags[t].offset == (nread + k)))
+            {
+              d_symbol_index = pmt::to_long(d_tags[t].value);
+
+              // Skip duplicated tags on the same item
+              while ((t < (int)d_tags.size()) && (d_tags[t].offset == (nread + k)))
+                t++;
+            }
+            else if (k || nread)
+              d_symbol_index = (d_symbol_index + 1) % d_symbols_per_frame;
+
             //printf("Symbol deinterleaver: d_symbol_index: %i\n", d_symbol_index);
 
             for (int q = 0; q < d_nsize; q++)
@@ -23,6 +23,7 @@
 
 #include <dvbt/symbol_inner_interleaver.h>
 #include <dvbt/reference_signals.h>
+#include <gnuradio/thread/thread.h>
 
 namespace gr {
   namespace dvbt {
@@ -47,23 +48,36 @@ namespace gr {
       int d_payload_length;
       int d_direction;
 
-      int * d_h;
-      const char * d_bit_perm;
+      const int * d_h;
       static const char d_bit_perm_2k[];
       static const char d_bit_perm_8k[];
 
+      // H tables are the same for all instances,
+      // generate them once for each transmission mode.
+      static int * d_h_2k;
+      static int * d_h_8k;
+      static gr::thread::mutex d_h_mutex;
+
       //Keeps the symbol index
       unsigned int d_symbol_index;
+      //Symbol index tags read in one call
+      std::vector<tag_t> d_tags;
+      const pmt::pmt_t d_symbol_index_key;
 
-      void generate_H();
+      static void generate_H(int * h, dvbt_transmission_mode_t transmission);
       int H(int q);
-      int calculate_R(int i);
 
     public:
       symbol_inner_interleaver_impl(int nsize, \
         dvbt_transmission_mode_t transmission, int direction);
       ~symbol_inner_interleaver_impl();
 
+      /*!
+       * Returns the H permutation table (payload length entries)
+       * for a transmission mode. Tables are shared process wide.
+       */
+      static const int * H_table(dvbt_transmission_mode_t transmission);
+
       void forecast (int noutput_items, gr_vector_int &ninput_items_required);
 
         /*!
@@ -34,6 +34,7 @@
 #include <xmmintrin.h>
 #include <stdio.h>
 #include <sys/time.h>
+#include <algorithm>
 
 //#define VITERBI_DEBUG 1
 
@@ -83,7 +84,48 @@ namespace gr {
       d_bsize(bsize),
       d_S0(S0),
       d_SK(SK),
-      d_init(0)
+      d_init(0),
+      d_params_key(pmt::string_to_symbol("transmission_parameters"))
+    {
+      set_code_rate();
+
+      printf("Viterbi: k: %i\n", d_k);
+      printf("Viterbi: n: %i\n", d_n);
+      printf("Viterbi: m: %i\n", d_m);
+      printf("Viterbi: block size: %i\n", d_bsize);
+
+      /*
+       * Code rate and constellation may change later (TPS), but
+       * output multiple and relative rate are not changed while running.
+       * They are set for the largest block (rate 7/8) and for the
+       * smallest out/in rate (QPSK, rate 1/2: km/8n = 1/8), so buffers
+       * fit any parameters. general_work decodes as many whole blocks
+       * of current code rate as fit.
+       */
+      assert((d_bsize * 7) % 8 == 0);
+      set_output_multiple(d_bsize * 7 / 8);
+      set_relative_rate(1.0 / 8.0);
+
+      // Allocate the buffer for the bits
+      // for the largest block (rate 7/8)
+      d_inbits = new unsigned char [2 * 7 * d_bsize];
+      if (d_inbits == NULL)
+        std::cout << "error allocating d_inbits" << std::endl;
+        
+
+      // TODO - clean this up
+      int amp = 100;
+      float RATE=0.5;
+      float ebn0 = 12.0;
+      float esn0 = RATE*pow(10.0, ebn0/10);
+      d_gen_met(mettab, amp, esn0, 0.0, 4);
+      d_viterbi_chunks_init(state0);
+
+      d_viterbi_chunks_init_sse2(metric0, path0);
+    }
+
+    void
+    viterbi_decoder_impl::set_code_rate()
     {
       //Determine k - input of encoder
       d_k = config.d_cr_k;
@@ -123,22 +165,14 @@ namespace gr {
         d_ntraceback = 5;
       }
 
-      printf("Viterbi: k: %i\n", d_k);
-      printf("Viterbi: n: %i\n", d_n);
-      printf("Viterbi: m: %i\n", d_m);
-      printf("Viterbi: block size: %i\n", d_bsize);
-
       /*
        * We input n bytes, each carrying m bits => nm bits
        * The result after decoding is km bits, therefore km/8 bytes.
        *
        * out/in rate is therefore km/8n in bytes
        */
-      assert((d_k * d_m) % (8 * d_n));
-      set_relative_rate((d_k * d_m) / (8 * d_n));
-
       assert ((d_bsize * d_n) % d_m == 0);
-      set_output_multiple (d_bsize * d_k / 8);
+      assert ((d_bsize * d_k) % 8 == 0);
 
       /*
        * Calculate process variables:
@@ -151,22 +185,31 @@ namespace gr {
       d_nbits = 2 * d_k * d_bsize;
       // Number of output bytes after decoding
       d_nout = d_nbits / 2 / 8;
+    }
 
-      // Allocate the buffer for the bits
-      d_inbits = new unsigned char [d_nbits];
-      if (d_inbits == NULL)
-        std::cout << "error allocating d_inbits" << std::endl;
-        
+    /*
+     * Change constellation and code rate to the ones received
+     * with a transmission_parameters tag.
+     * The decoder works on the high priority stream.
+     * Returns 1 if parameters changed.
+     */
+    int
+    viterbi_decoder_impl::set_transmission_parameters(long params)
+    {
+      dvbt_config rcv(config);
+      rcv.set_transmission_parameters(params);
 
-      // TODO - clean this up
-      int amp = 100;
-      float RATE=0.5;
-      float ebn0 = 12.0;
-      float esn0 = RATE*pow(10.0, ebn0/10);
-      d_gen_met(mettab, amp, esn0, 0.0, 4);
-      d_viterbi_chunks_init(state0);
+      if ((rcv.d_constellation == config.d_constellation) && \
+          (rcv.d_code_rate_HP == config.d_code_rate_HP))
+        return 0;
 
-      d_viterbi_chunks_init_sse2(metric0, path0);
+      config.set_constellation(rcv.d_constellation);
+      config.set_code_rate_HP(rcv.d_code_rate_HP);
+      config.set_code_rate_LP(rcv.d_code_rate_HP);
+
+      set_code_rate();
+
+      return 1;
     }
 
     /*
@@ -180,7 +223,9 @@ namespace gr {
     void
     viterbi_decoder_impl::forecast (int noutput_items, gr_vector_int &ninput_items_required)
     {
-       int input_required = noutput_items * 8 * d_n / (d_k * d_m);
+       // Whole blocks of current code rate
+       int nblocks = noutput_items / d_nout;
+       int input_required = (nblocks ? nblocks : 1) * d_nsymbols;
 
        unsigned ninputs = ninput_items_required.size();
        for (unsigned int i = 0; i < ninputs; i++) {
@@ -195,11 +240,42 @@ namespace gr {
                        gr_vector_void_star &output_items)
     {
         int nstreams = input_items.size();
-        int nblocks = 8 * noutput_items / (d_bsize * d_k);
+        int nblocks = std::min(noutput_items / d_nout, ninput_items[0] / d_nsymbols);
         int out_count = 0;
         
         gettimeofday(&tvs, &tzs);
 
+        /*
+         * Look for a tag that signals new transmission parameters.
+         * Consume up to it, then change code rate and constellation
+         * and reset the decoder.
+         * Block sizes change with the code rate, so the number of
+         * blocks is calculated again.
+         */
+        const uint64_t nread0 = this->nitems_read(0); //number of items read on port 0
+        this->get_tags_in_range(d_params_tags, 0, nread0, nread0 + (nblocks * d_nsymbols), d_params_key);
+
+        for (unsigned int i = 0; i < d_params_tags.size(); i++)
+        {
+          if (d_params_tags[i].offset - nread0)
+          {
+            consume_each(d_params_tags[i].offset - nread0);
+            return (0);
+          }
+
+          if (set_transmission_parameters(pmt::to_long(d_params_tags[i].value)))
+          {
+            d_init = 0;
+            d_viterbi_chunks_init_sse2(metric0, path0);
+
+            nblocks = std::min(noutput_items / d_nout, ninput_items[0] / d_nsymbols);
+          }
+        }
+
+        // Wait for a whole block of current code rate
+        if (nblocks == 0)
+          return (0);
+
         for (int m=0;m<nstreams;m++)
         {
           const unsigned char *in = (const unsigned char *) input_items[m];
@@ -210,20 +286,19 @@ namespace gr {
            * that are in input buffer so far.
            * This will actually reset the viterbi decoder.
            */
-          std::vector<tag_t> tags;
           const uint64_t nread = this->nitems_read(0); //number of items read on port 0
-          this->get_tags_in_range(tags, 0, nread, nread + (nblocks * d_nsymbols), pmt::string_to_symbol("superframe_start"));
+          this->get_tags_in_range(d_tags, 0, nread, nread + (nblocks * d_nsymbols), pmt::string_to_symbol("superframe_start"));
 
-          if (tags.size())
+          if (d_tags.size())
           {
             d_init = 0;
             d_viterbi_chunks_init_sse2(metric0, path0);
 
-            //printf("viterbi: superframe_start: %i\n", tags[0].offset - nread);
+            //printf("viterbi: superframe_start: %i\n", d_tags[0].offset - nread);
 
-            if (tags[0].offset - nread)
+            if (d_tags[0].offset - nread)
             {
-              consume_each(tags[0].offset - nread);
+              consume_each(d_tags[0].offset - nread);
               return (0);
             }
           }
@@ -293,7 +368,7 @@ namespace gr {
           }
         }
 
-        int to_out = noutput_items;
+        int to_out = nblocks * d_nout;
         
         if (d_init == 0)
         {
@@ -86,6 +86,17 @@ namespace gr {
       // This is used to get rid of traceback on the first frame
       int d_init;
 
+      // Transmission parameters tag key
+      const pmt::pmt_t d_params_key;
+
+      // Tags on current input
+      std::vector<tag_t> d_tags;
+      std::vector<tag_t> d_params_tags;
+
+      // Set code rate dependent parameters from config
+      void set_code_rate();
+      int set_transmission_parameters(long params);
+
     public:
       viterbi_decoder_impl(dvbt_constellation_t constellation, \
                   dvbt_hierarchy_t hierarchy, dvbt_code_rate_t coderate, int bsize, int S0, int SK);
@@ -0,0 +1,71 @@
+#!/usr/bin/env python
+# 
+# Copyright 2013 <Bogdan Diaconescu, yo3iiu@yo3iiu.ro>.
+# 
+# This is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 3, or (at your option)
+# any later version.
+# 
+# This software is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+# 
+# You should have received a copy of the GNU General Public License
+# along with this software; see the file COPYING.  If not, write to
+# the Free Software Foundation, Inc., 51 Franklin Street,
+# Boston, MA 02110-1301, USA.
+# 
+
+from gnuradio import gr, gr_unittest, blocks
+import dvbt_swig as dvbt
+import random
+
+class qa_ofdm_symbol_builder (gr_unittest.TestCase):
+
+    def setUp (self):
+        self.tb = gr.top_block ()
+
+    def tearDown (self):
+        self.tb = None
+
+    def compare_with_chain (self, constellation, bits, transmission_mode, payload_length, fft_length):
+        # More than one frame (68 symbols)
+        nsymbols = 2 * 68 + 5
+
+        random.seed(1)
+        src_data = [random.randint(0, (1 << bits) - 1) for i in range(nsymbols * payload_length)]
+
+        src = blocks.vector_source_b(src_data, False, payload_length)
+
+        # Fused block
+        builder = dvbt.ofdm_symbol_builder(constellation, dvbt.NH, dvbt.C2_3, dvbt.C2_3, \
+                dvbt.G1_8, transmission_mode, 1, 0x55, 1.0)
+        dst_builder = blocks.vector_sink_c(fft_length)
+
+        # Chain it replaces
+        interleaver = dvbt.symbol_inner_interleaver(payload_length, transmission_mode, 1)
+        mapper = dvbt.dvbt_map(payload_length, constellation, dvbt.NH, transmission_mode, 1.0)
+        pilots = dvbt.reference_signals(gr.sizeof_gr_complex, payload_length, fft_length, \
+                constellation, dvbt.NH, dvbt.C2_3, dvbt.C2_3, dvbt.G1_8, transmission_mode, 1, 0x55)
+        dst_chain = blocks.vector_sink_c(fft_length)
+
+        self.tb.connect(src, builder, dst_builder)
+        self.tb.connect(src, interleaver, mapper, pilots, dst_chain)
+        self.tb.run ()
+
+        self.assertEqual(len(dst_builder.data()), nsymbols * fft_length)
+        self.assertComplexTuplesAlmostEqual(dst_builder.data(), dst_chain.data(), 6)
+
+    def test_001_t (self):
+        # 2k, QAM64
+        self.compare_with_chain(dvbt.QAM64, 6, dvbt.T2k, 1512, 2048)
+
+    def test_002_t (self):
+        # 8k, QAM16
+        self.compare_with_chain(dvbt.QAM16, 4, dvbt.T8k, 6048, 8192)
+
+
+if __name__ == '__main__':
+    gr_unittest.run(qa_ofdm_symbol_builder, "qa_ofdm_symbol_builder.xml")
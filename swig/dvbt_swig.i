@@ -28,6 +28,7 @@
 #include "dvbt/reed_solomon_dec.h"
 #include "dvbt/ofdm_sym_acquisition.h"
 #include "dvbt/viterbi_decoder.h"
+#include "dvbt/ofdm_symbol_builder.h"
 %}
 
 %include "dvbt/test.h"
@@ -50,6 +51,7 @@
 %include "dvbt/reed_solomon_dec.h"
 %include "dvbt/ofdm_sym_acquisition.h"
 %include "dvbt/viterbi_decoder.h"
+%include "dvbt/ofdm_symbol_builder.h"
 GR_SWIG_BLOCK_MAGIC2(dvbt, test);
 GR_SWIG_BLOCK_MAGIC2(dvbt, vector_pad);
 GR_SWIG_BLOCK_MAGIC2(dvbt, reference_signals);
@@ -69,3 +71,4 @@ GR_SWIG_BLOCK_MAGIC2(dvbt, reed_solomon_enc);
 GR_SWIG_BLOCK_MAGIC2(dvbt, reed_solomon_dec);
 GR_SWIG_BLOCK_MAGIC2(dvbt, ofdm_sym_acquisition);
 GR_SWIG_BLOCK_MAGIC2(dvbt, viterbi_decoder);
+GR_SWIG_BLOCK_MAGIC2(dvbt, ofdm_symbol_builder);